@@ -21,12 +21,30 @@
 
 
 #include "NEUQUANT.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define batchsimd	1			/* x86 kernels with runtime dispatch */
+#endif
+#ifdef __GNUC__
+#define threadlocal	__thread		/* search state of each mapping thread */
+#else
+#define threadlocal				/* shared: tiledmap runs one thread */
+#endif
 
 
 /* Network Definitions
    ------------------- */
    
-#define maxnetpos	255
 #define netbiasshift	4			/* bias for colour values */
 #define ncycles		100			/* no. of learning cycles */
 
@@ -57,25 +75,146 @@ int alphadec;					/* biased by 10 bits */
 #define alpharadbshift  18
 #define alpharadbias    262144
 
+/* defs for convergence monitoring */
+#define convfinal	10			/* cycles kept after convergence */
+
+/* defs for warm starts */
+#define warmdefault	25			/* tail of the schedule rerun */
+
+/* defs for multi-resolution learning */
+#define multiresrad	8			/* full resolution once rad drops below this */
+
+/* defs for deadline-driven quantization */
+#define calpixels	65536			/* size of the calibration picture */
+#define lutshift	3			/* coarse lut keeps 5 bits per colour */
+#define lutsize		32768
+#define budgetslack	0.8			/* plan to use this part of the budget */
+#define budgetcheck	4096			/* pixels mapped between clock checks */
+#define mincycles	20			/* fewest cycles the planner will pick */
+
+
+/* defs for k-d tree search */
+#define kdleafsize	8			/* neurons per leaf bucket */
+#define kdnodes		128			/* internal nodes for netsize/kdleafsize leaves */
+
+/* defs for batched brute-force mapping */
+#define batchwidth	4			/* pixels sharing each palette load */
+#define batchfar	16383			/* padding colour component, out of reach */
+#define batchspan	1073741824		/* most pixels given to a kernel at once */
+
+/* defs for squared distances */
+#define l2biasshift	8			/* bias to squared biased colour units */
+#define l2maxdist	200000			/* above 3*255*255 */
+
+/* defs for triangle pruning in contest */
+#define seedshift	8			/* brightness buckets of 256 (biased) */
+#define seeds		48			/* 3*(255 << netbiasshift) >> seedshift */
+
+/* defs for grid search */
+#define gridshift	4			/* cells 16 levels wide */
+#define gridside	16
+#define gridcells	4096			/* gridside cubed */
+
+/* defs for clustered search */
+#define clusters	16			/* top-level centroids */
+#define clusteriters	8			/* k-means passes over the palette */
+
+/* defs for the inverse-colormap lut and its file */
+#define lutentries	16777216		/* one colour number per 24-bit BGR */
+#define lutoffset	4096			/* lut starts a page into the file */
+#define lutmagic	"NQLUT01\n"
+
+/* defs for planar input */
+#define planarchunk	16384			/* pixels interleaved at a time for mapping */
+
+/* defs for streaming */
+#define streamreserve	262144			/* pixels kept to train on (768kb) */
+#define streamrevisit	4			/* most samples learn() takes per kept pixel */
+#define spillrun	64			/* most pixels per spill token */
+#define spillliteral	0x00			/* token: that many BGR triples follow */
+#define spillleft	0x40			/* token: repeat the pixel to the left */
+#define spillabove	0x80			/* token: copy the row above */
+#define tilethreads	64			/* most threads mapping tiles */
+
+/* defs for gif output */
+#define gifmaxcode	4096			/* lzw codes are at most 12 bits */
+#define gifhash		5003			/* code table slots, prime, 80% full at most */
+#define gifbands	4			/* mapped bands queued for the encoder */
+
+/* defs for png output */
+#define pngband		262144			/* pixels deflated independently per band */
+#define pngfree		0			/* slot states */
+#define pngbusy		1
+#define pngdone		2
+
+/* defs for projected axis search */
+#define axisscale	16			/* largest axis weight */
+#define axiscands	5			/* b, g, r, grey and principal axes */
+#define axisjitter	8			/* probe offset from palette colours */
+
 
 /* Types and Global Variables
    -------------------------- */
    
-static unsigned char *thepicture;		/* the input image itself */
-static int lengthcount;				/* lengthcount = H*W*3 */
+static const unsigned char *picchan[3];		/* b, g and r of the first pixel */
+static long picwidth;				/* pixels per row */
+static int picstride;				/* bytes from a pixel to the next */
+static long picpitch;				/* bytes from a row to the next */
+static int piclinear;				/* rows follow on: pixel pix at pix*picstride */
+static int picpacking;				/* viewbytes or view565 */
+static const float *picfloat[3];		/* or float planes 0..255 */
+static long lengthcount;			/* lengthcount = H*W*3 */
 
 static int samplefac;				/* sampling factor 1..30 */
+static long learnpixels;			/* samples learn() takes, 0 = by samplefac */
+static int multiresfac;				/* pixels per coarse pixel, 0 = off */
+static int learncycles = ncycles;		/* cycles actually trained */
+static int warmcycles;				/* schedule tail for warm start, 0 = cold */
+
+static long movement;				/* neuron displacement this cycle */
+static int convthresh;				/* displacement per sample, 0 = off */
+static int convcycles;				/* quiet cycles needed to converge */
+static int cyclesskipped;			/* cycles cut by the last learn() */
+
+static snapshotfunc snapfunc;			/* palette preview callback */
+static int snapevery;				/* cycles between snapshots */
+static void *snapdata;
 
 
 typedef int pixel[4];				/* BGRc */
 static pixel network[netsize];			/* the network itself */
+static int netcolours = netsize;		/* neurons in use, 2..netsize */
 
 static int netindex[256];			/* for network lookup - really 256 */
 
+static int searchmode;				/* index built by inxbuild */
+static int approxeps;				/* extra L1 error allowed by searchapprox */
+static threadlocal long searchqueries;		/* searches since inxbuild */
+static threadlocal long searchvisits;		/* neurons examined by them */
+static threadlocal long runpixels;		/* pixels given to mapimage */
+static threadlocal long runhits;		/* of those, copied from a neighbour */
+
+static void kdbuild();
+static void axisbuild();
+static void batchbuild();
+static void gridbuild();
+static void clusterbuild();
+static int lutbuild();
+static void lutfree();
+
 static int bias [netsize];			/* bias and freq arrays for learning */
 static int freq [netsize];
 static int radpower[initrad];			/* radpower for precomputation */
 
+static int metric;				/* metricl1 or metricl2 */
+static int tripruning;				/* triangle pruning in contest */
+static short netdist[netsize][netsize];		/* neuron distances at cycle start */
+static int drift[netsize];			/* neuron movement since then */
+static long contestskips[ncycles+1];		/* neurons skipped in each cycle */
+static int contestcycles;			/* cycles counted there */
+static long contestdelta;			/* samples in each */
+static int seedtable[seeds];			/* neuron for each brightness */
+
 
 int getNetwork(int i, int j)
 {
@@ -85,23 +224,427 @@ int getNetwork(int i, int j)
 /* Initialise network in range (0,0,0) to (255,255,255) and set parameters
    ----------------------------------------------------------------------- */
 
-void initnet(unsigned char *thepic, int len, int sample)
+void initnet(unsigned char *thepic, long len, int sample)
 {
 	register int i;
 	register int *p;
 	
-	thepicture = thepic;
+	if (thepic) {				/* one row of packed BGR */
+		picchan[0] = thepic;
+		picchan[1] = thepic + 1;
+		picchan[2] = thepic + 2;
+	}
+	picwidth = (len >= 3) ? len/3 : 1;
+	picstride = 3;
+	picpitch = len;
+	piclinear = 1;
+	picpacking = viewbytes;
+	picfloat[0] = picfloat[1] = picfloat[2] = NULL;
 	lengthcount = len;
 	samplefac = sample;
+	learnpixels = 0;
+	warmcycles = 0;
 	
-	for (i=0; i<netsize; i++) {
+	for (i=0; i<netcolours; i++) {
 		p = network[i];
-		p[0] = p[1] = p[2] = (i << (netbiasshift+8))/netsize;
-		freq[i] = intbias/netsize;	/* 1/netsize */
+		p[0] = p[1] = p[2] = (i << (netbiasshift+8))/netcolours;
+		freq[i] = intbias/netcolours;	/* 1/netcolours */
 		bias[i] = 0;
 	}
 }
 
+
+/* Initialise network from separate b, g and r planes, read in place
+   ----------------------------------------------------------------- */
+
+void initnetplanar(const unsigned char *b, const unsigned char *g, const unsigned char *r, long pixels, int sample)
+{
+	initnet(NULL, 3*pixels, sample);
+	picchan[0] = b;
+	picchan[1] = g;
+	picchan[2] = r;
+	picstride = 1;
+}
+
+void initnetplanarf(const float *b, const float *g, const float *r, long pixels, int sample)
+{
+	initnet(NULL, 3*pixels, sample);
+	picfloat[0] = b;
+	picfloat[1] = g;
+	picfloat[2] = r;
+}
+
+
+/* Initialise network from a padded or multi-byte-pixel image, read in place
+   ------------------------------------------------------------------------- */
+
+void initnetview(const imageview *view, int sample)
+{
+	initnet(NULL, 3L*view->width*view->height, sample);
+	picchan[0] = view->base + view->boffset;
+	picchan[1] = view->base + view->goffset;
+	picchan[2] = view->base + view->roffset;
+	picwidth = view->width;
+	picstride = view->stride;
+	picpitch = view->pitch;
+	piclinear = (view->pitch == (long) view->width*view->stride || view->height == 1);
+	picpacking = view->packing;
+}
+
+
+/* Describe a picture in one of the common pixel formats as an image view
+   ---------------------------------------------------------------------- */
+
+imageview makeview(const void *base, int width, int height, int pitch, int format)
+{
+	/* offsets of b, g and r in each pixel format; 16-bit channels are */
+	/* little-endian, so their high bytes truncate them to 8 bits */
+	static const int layout[][4] = {
+		{3, 0, 1, 2},		/* pixbgr8 */
+		{3, 2, 1, 0},		/* pixrgb8 */
+		{4, 2, 1, 0},		/* pixrgba8 */
+		{4, 0, 1, 2},		/* pixbgra8 */
+		{4, 3, 2, 1},		/* pixargb8 */
+		{2, 0, 0, 0},		/* pixrgb565 */
+		{6, 5, 3, 1}		/* pixrgb48 */
+	};
+	imageview view;
+
+	if (format < pixbgr8 || format > pixrgb48) format = pixbgr8;
+	view.base = (const unsigned char *) base;
+	view.width = width;
+	view.height = height;
+	view.pitch = pitch ? pitch : width*layout[format][0];
+	view.stride = layout[format][0];
+	view.boffset = layout[format][1];
+	view.goffset = layout[format][2];
+	view.roffset = layout[format][3];
+	view.packing = (format == pixrgb565) ? view565 : viewbytes;
+	return view;
+}
+
+
+/* Read a decimal header field of a netpbm file at *p, skipping white space
+   and comments; -1 if there is none
+   ------------------------------------------------------------------------ */
+
+static long pnmnumber(const unsigned char **p, const unsigned char *end)
+{
+	const unsigned char *q;
+	long n;
+
+	q = *p;
+	for (;;) {
+		while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) q++;
+		if (q == end || *q != '#') break;
+		while (q < end && *q != '\n') q++;
+	}
+	if (q == end || *q < '0' || *q > '9') return -1;
+	for (n=0; q<end && *q>='0' && *q<='9' && n<100000000; q++) n = 10*n + (*q - '0');
+	*p = q;
+	return n;
+}
+
+
+/* Parse the header of a PGM, PPM or PAM file, leaving *p at the pixels
+   -------------------------------------------------------------------- */
+
+static int pnmheader(const unsigned char **p, const unsigned char *end, long *width, long *height, long *depth, long *maxval)
+{
+	const unsigned char *q;
+	long *field;
+
+	if (end - *p < 3 || (*p)[0] != 'P' || (*p)[1] < '5' || (*p)[1] > '7') return -1;
+	q = *p + 2;
+	if ((*p)[1] != '7') {			/* P5 grey or P6 rgb: three numbers */
+		*depth = ((*p)[1] == '5') ? 1 : 3;
+		*width = pnmnumber(&q, end);
+		*height = pnmnumber(&q, end);
+		*maxval = pnmnumber(&q, end);
+		if (q == end) return -1;
+		*p = q + 1;			/* a single white space ends the header */
+		return 0;
+	}
+
+	/* P7: lines of keyword and value up to ENDHDR */
+	*width = *height = *depth = *maxval = -1;
+	for (;;) {
+		while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) q++;
+		if (end - q >= 6 && memcmp(q, "ENDHDR", 6) == 0) break;
+		field = NULL;
+		if (end - q >= 5 && memcmp(q, "WIDTH", 5) == 0) field = width;
+		else if (end - q >= 6 && memcmp(q, "HEIGHT", 6) == 0) field = height;
+		else if (end - q >= 5 && memcmp(q, "DEPTH", 5) == 0) field = depth;
+		else if (end - q >= 6 && memcmp(q, "MAXVAL", 6) == 0) field = maxval;
+		while (q < end && *q != ' ' && *q != '\t' && *q != '\n') q++;
+		if (field) *field = pnmnumber(&q, end);
+		while (q < end && *q != '\n') q++;	/* TUPLTYPE, comments */
+		if (q == end) return -1;
+	}
+	while (q < end && *q != '\n') q++;
+	if (q == end) return -1;
+	*p = q + 1;
+	return 0;
+}
+
+
+/* Map a netpbm file and describe its pixels in place
+   -------------------------------------------------- */
+
+int pnmopen(const char *filename, pnmfile *pnm)
+{
+	const unsigned char *p,*end;
+	struct stat st;
+	void *base;
+	long width,height,depth,maxval,size;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < 3) {close(fd); return -1;}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return -1;
+
+	p = (const unsigned char *) base;
+	end = p + st.st_size;
+	if (pnmheader(&p, end, &width, &height, &depth, &maxval) != 0 || width < 1 || height < 1
+	    || depth < 1 || depth > 4 || (maxval != 255 && maxval != 65535)) {
+		munmap(base, st.st_size);
+		return -1;
+	}
+	/* 16-bit samples are big-endian, so their high bytes come first */
+	size = (maxval == 255) ? 1 : 2;
+	pnm->view.stride = depth*size;
+	if (width > 0x7fffffff / pnm->view.stride || height > (end - p) / (width*pnm->view.stride)) {
+		munmap(base, st.st_size);
+		return -1;
+	}
+	pnm->view.base = p;
+	pnm->view.width = width;
+	pnm->view.height = height;
+	pnm->view.pitch = width*pnm->view.stride;
+	pnm->view.roffset = 0;			/* grey (with alpha) is read as r = g = b */
+	pnm->view.goffset = (depth >= 3) ? size : 0;
+	pnm->view.boffset = (depth >= 3) ? 2*size : 0;
+	pnm->view.packing = viewbytes;
+	pnm->addr = base;
+	pnm->length = st.st_size;
+	return 0;
+}
+
+
+/* Advise the kernel of the order the pixels will be read in
+   --------------------------------------------------------- */
+
+void pnmadvise(const pnmfile *pnm, int access)
+{
+	madvise(pnm->addr, pnm->length, (access == accesssequential) ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+
+/* Unmap a netpbm file
+   ------------------- */
+
+void pnmclose(pnmfile *pnm)
+{
+	if (pnm->addr) munmap(pnm->addr, pnm->length);
+	pnm->addr = NULL;
+}
+
+
+/* Convert a float channel value to 0..255 as a cast would, clamped
+   ---------------------------------------------------------------- */
+
+static int planebyte(float f)
+{
+	if (f <= 0) return 0;
+	if (f >= 255) return 255;
+	return (int) f;
+}
+
+
+/* Widen a 5-6-5 pixel (red in the top bits) to 8 bits per channel
+   --------------------------------------------------------------- */
+
+static void expand565(int v, int *b, int *g, int *r)
+{
+	*b = v & 31;
+	*g = (v >> 5) & 63;
+	*r = (v >> 11) & 31;
+	*b = (*b << 3) | (*b >> 2);
+	*g = (*g << 2) | (*g >> 4);
+	*r = (*r << 3) | (*r >> 2);
+}
+
+
+/* Fetch pixel (x,y) of the picture given to initnet...
+   ------------------------------------------------------- */
+
+static void picturepixelxy(long x, long y, int *b, int *g, int *r)
+{
+	register long o;
+
+	if (picfloat[0]) {
+		o = y*picwidth + x;
+		*b = planebyte(picfloat[0][o]);
+		*g = planebyte(picfloat[1][o]);
+		*r = planebyte(picfloat[2][o]);
+	}
+	else {
+		o = x*picstride + y*picpitch;
+		if (picpacking == view565) {
+			expand565(picchan[0][o] | (picchan[0][o+1] << 8), b, g, r);
+			return;
+		}
+		*b = picchan[0][o];
+		*g = picchan[1][o];
+		*r = picchan[2][o];
+	}
+}
+
+
+/* ...or pixel pix in row order
+   ---------------------------- */
+
+static void picturepixel(long pix, int *b, int *g, int *r)
+{
+	if (piclinear) picturepixelxy(pix, 0, b, g, r);	/* no divide per sample */
+	else picturepixelxy(pix % picwidth, pix / picwidth, b, g, r);
+}
+
+
+/* Reseed network from a previous colour map to warm start learning (after initnet)
+   -------------------------------------------------------------------------------- */
+
+void initwarm(const unsigned char *map, const int *prevfreq, const int *prevbias, int cycles)
+{
+	register int i;
+	register int *p;
+
+	for (i=0; i<netcolours; i++) {
+		p = network[i];
+		p[0] = map[3*i] << netbiasshift;
+		p[1] = map[3*i+1] << netbiasshift;
+		p[2] = map[3*i+2] << netbiasshift;
+		if (prevfreq) freq[i] = prevfreq[i];
+		if (prevbias) bias[i] = prevbias[i];
+	}
+	if (cycles <= 0) cycles = warmdefault;
+	warmcycles = (cycles < ncycles) ? cycles : ncycles;
+}
+
+
+/* Copy the freq and bias arrays left by learn() for a later warm start
+   -------------------------------------------------------------------- */
+
+void getfreqbias(int *f, int *b)
+{
+	memcpy(f, freq, sizeof(freq));
+	memcpy(b, bias, sizeof(bias));
+}
+
+
+/* Select multi-resolution learning (fac pixels box-filtered per coarse pixel)
+   --------------------------------------------------------------------------- */
+
+void setmultires(int fac)
+{
+	multiresfac = (fac > 1) ? fac : 0;
+}
+
+
+/* Select early termination once learning has converged
+   ----------------------------------------------------- */
+
+void setconvergence(int thresh, int cycles)
+{
+	convthresh = (thresh > 0) ? thresh : 0;
+	convcycles = (cycles > 0) ? cycles : 1;
+}
+
+
+/* Select a callback given palette snapshots every few learning cycles
+   ------------------------------------------------------------------- */
+
+void setsnapshot(snapshotfunc f, int every, void *data)
+{
+	snapfunc = f;
+	snapevery = (every > 0) ? every : 1;
+	snapdata = data;
+}
+
+
+/* Select L1 or squared Euclidean distance for learning and mapping
+   ---------------------------------------------------------------- */
+
+void setmetric(int m)
+{
+	metric = m;
+}
+
+
+/* Select the number of colours learn() trains (before initnet)
+   ------------------------------------------------------------ */
+
+void setcolours(int n)
+{
+	if (n < 2) n = 2;
+	if (n > netsize) n = netsize;
+	netcolours = n;
+}
+
+
+/* Return the number of colours in use
+   ----------------------------------- */
+
+int getcolours()
+{
+	return netcolours;
+}
+
+
+/* Select triangle-inequality pruning in contest
+   --------------------------------------------- */
+
+void settriangle(int on)
+{
+	tripruning = on;
+}
+
+
+/* Return the fraction of neurons contest skipped in each cycle of the last learn()
+   -------------------------------------------------------------------------------- */
+
+int getcontestskips(double *rates)
+{
+	int i;
+
+	for (i=0; i<contestcycles; i++)
+		rates[i] = (double) contestskips[i]/((double) contestdelta*netcolours);
+	return contestcycles;
+}
+
+
+/* Limit the number of cycles trained by learn()
+   --------------------------------------------- */
+
+void setcycles(int cycles)
+{
+	if (cycles <= convfinal) cycles = convfinal+1;
+	if (cycles > ncycles) cycles = ncycles;
+	learncycles = cycles;
+}
+
+
+/* Return the number of cycles skipped by the last learn()
+   ------------------------------------------------------- */
+
+int learnskipped()
+{
+	return cyclesskipped;
+}
+
 	
 /* Unbias network to give byte values 0..255 and record position i to prepare for sort
    ----------------------------------------------------------------------------------- */
@@ -110,7 +653,7 @@ void unbiasnet()
 {
 	int i,j,temp;
 
-	for (i=0; i<netsize; i++) {
+	for (i=0; i<netcolours; i++) {
 		for (j=0; j<3; j++) {
 			/* OLD CODE: network[i][j] >>= netbiasshift; */
 			/* Fix based on bug report by Juergen Weigert jw@suse.de */
@@ -131,11 +674,28 @@ void writecolourmap(FILE* f)
 	int i,j;
 
 	for (i=2; i>=0; i--) 
-		for (j=0; j<netsize; j++) 
+		for (j=0; j<netcolours; j++) 
 			putc(network[j][i], f);
 }
 
 
+/* Copy colour map as BGR triples by colour number (before or after inxbuild)
+   -------------------------------------------------------------------------- */
+
+void getcolourmap(unsigned char *map)
+{
+	int i;
+	register int *p;
+
+	for (i=0; i<netcolours; i++) {
+		p = network[i];
+		map[3*p[3]] = p[0];
+		map[3*p[3]+1] = p[1];
+		map[3*p[3]+2] = p[2];
+	}
+}
+
+
 /* Insertion sort of network and building of netindex[0..255] (to do after unbias)
    ------------------------------------------------------------------------------- */
 
@@ -147,12 +707,12 @@ void inxbuild()
 
 	previouscol = 0;
 	startpos = 0;
-	for (i=0; i<netsize; i++) {
+	for (i=0; i<netcolours; i++) {
 		p = network[i];
 		smallpos = i;
 		smallval = p[1];			/* index on g */
-		/* find smallest in i..netsize-1 */
-		for (j=i+1; j<netsize; j++) {
+		/* find smallest in i..netcolours-1 */
+		for (j=i+1; j<netcolours; j++) {
 			q = network[j];
 			if (q[1] < smallval) {		/* index on g */
 				smallpos = j;
@@ -175,8 +735,18 @@ void inxbuild()
 			startpos = i;
 		}
 	}
-	netindex[previouscol] = (startpos+maxnetpos)>>1;
-	for (j=previouscol+1; j<256; j++) netindex[j] = maxnetpos; /* really 256 */
+	netindex[previouscol] = (startpos+netcolours-1)>>1;
+	for (j=previouscol+1; j<256; j++) netindex[j] = netcolours-1; /* really 256 */
+
+	if (searchmode == searchkdtree) kdbuild();
+	if (searchmode == searchaxis) axisbuild();
+	if (searchmode == searchgrid) gridbuild();
+	if (searchmode == searchcluster) clusterbuild();
+	batchbuild();
+	if (searchmode == searchlut) lutbuild();
+	else lutfree();				/* any lut is for an old network */
+	searchqueries = searchvisits = 0;
+	runpixels = runhits = 0;
 }
 
 
@@ -187,18 +757,20 @@ int inxsearch(register int b, register int g, register int r)
 {
 	register int i,j,dist,a,bestd;
 	register int *p;
-	int best;
+	int best,visits;
 
 	bestd = 1000;		/* biggest possible dist is 256*3 */
 	best = -1;
+	visits = 0;
 	i = netindex[g];	/* index on g */
 	j = i-1;		/* start at netindex[g] and work outwards */
 
-	while ((i<netsize) || (j>=0)) {
-		if (i<netsize) {
+	while ((i<netcolours) || (j>=0)) {
+		if (i<netcolours) {
 			p = network[i];
+			visits++;
 			dist = p[1] - g;		/* inx key */
-			if (dist >= bestd) i = netsize;	/* stop iter */
+			if (dist >= bestd) i = netcolours;	/* stop iter */
 			else {
 				i++;
 				if (dist<0) dist = -dist;
@@ -213,6 +785,7 @@ int inxsearch(register int b, register int g, register int r)
 		}
 		if (j>=0) {
 			p = network[j];
+			visits++;
 			dist = g - p[1]; /* inx key - reverse dif */
 			if (dist >= bestd) j = -1; /* stop iter */
 			else {
@@ -228,174 +801,3571 @@ int inxsearch(register int b, register int g, register int r)
 			}
 		}
 	}
+	searchqueries++;
+	searchvisits += visits;
 	return(best);
 }
 
 
-/* Search for biased BGR values
-   ---------------------------- */
+/* Search as inxsearch for the nearest BGR values in squared distance
+   ------------------------------------------------------------------ */
 
-int contest(register int b, register int g, register int r)
+int l2search(register int b, register int g, register int r)
 {
-	/* finds closest neuron (min dist) and updates freq */
-	/* finds best neuron (min dist-bias) and returns position */
-	/* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
-	/* bias[i] = gamma*((1/netsize)-freq[i]) */
-
-	register int i,dist,a,biasdist,betafreq;
-	int bestpos,bestbiaspos,bestd,bestbiasd;
-	register int *p,*f, *n;
+	register int i,j,dist,a,bestd;
+	register int *p;
+	int best,visits;
 
-	bestd = ~(((int) 1)<<31);
-	bestbiasd = bestd;
-	bestpos = -1;
-	bestbiaspos = bestpos;
-	p = bias;
-	f = freq;
+	bestd = l2maxdist;
+	best = -1;
+	visits = 0;
+	i = netindex[g];	/* index on g */
+	j = i-1;		/* start at netindex[g] and work outwards */
 
-	for (i=0; i<netsize; i++) {
-		n = network[i];
-		dist = n[0] - b;   if (dist<0) dist = -dist;
-		a = n[1] - g;   if (a<0) a = -a;
-		dist += a;
-		a = n[2] - r;   if (a<0) a = -a;
-		dist += a;
-		if (dist<bestd) {bestd=dist; bestpos=i;}
-		biasdist = dist - ((*p)>>(intbiasshift-netbiasshift));
-		if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
-		betafreq = (*f >> betashift);
-		*f++ -= betafreq;
-		*p++ += (betafreq<<gammashift);
+	while ((i<netcolours) || (j>=0)) {
+		if (i<netcolours) {
+			p = network[i];
+			visits++;
+			dist = p[1] - g;		/* inx key */
+			dist *= dist;
+			if (dist >= bestd) i = netcolours;	/* stop iter */
+			else {
+				i++;
+				a = p[0] - b;
+				dist += a*a;
+				if (dist<bestd) {
+					a = p[2] - r;
+					dist += a*a;
+					if (dist<bestd) {bestd=dist; best=p[3];}
+				}
+			}
+		}
+		if (j>=0) {
+			p = network[j];
+			visits++;
+			dist = g - p[1]; /* inx key - reverse dif */
+			dist *= dist;
+			if (dist >= bestd) j = -1; /* stop iter */
+			else {
+				j--;
+				a = p[0] - b;
+				dist += a*a;
+				if (dist<bestd) {
+					a = p[2] - r;
+					dist += a*a;
+					if (dist<bestd) {bestd=dist; best=p[3];}
+				}
+			}
+		}
 	}
-	freq[bestpos] += beta;
-	bias[bestpos] -= betagamma;
-	return(bestbiaspos);
+	searchqueries++;
+	searchvisits += visits;
+	return(best);
 }
 
 
-/* Move neuron i towards biased (b,g,r) by factor alpha
-   ---------------------------------------------------- */
+/* Search as inxsearch, but settle for a colour within approxeps of nearest
+   ------------------------------------------------------------------------ */
 
-void altersingle(register int alpha, register int i, register int b, register int g, register int r)
+int approxsearch(int b, int g, int r)
 {
-	register int *n;
+	/* every unvisited entry on a side is at least its g difference away, */
+	/* so once both sides reach bestd-approxeps nothing left can beat */
+	/* bestd by more than approxeps */
 
-//	printf("New point %d: ", i);
+	register int i,j,dist,a,bestd,stop;
+	register int *p;
+	int best,visits;
 
-	n = network[i];				/* alter hit neuron */
-	*n -= (alpha*(*n - b)) / initalpha;
-//	printf("%f, ", *n / 16.0);
-	n++;
-	*n -= (alpha*(*n - g)) / initalpha;
-//  printf("%f, ", *n / 16.0);
-	n++;
-	*n -= (alpha*(*n - r)) / initalpha;
-//  printf("%f\n", *n / 16.0);
-}
+	bestd = 1000;		/* biggest possible dist is 256*3 */
+	stop = bestd - approxeps;
+	best = -1;
+	visits = 0;
+	i = netindex[g];	/* index on g */
+	j = i-1;		/* start at netindex[g] and work outwards */
 
+	while ((i<netcolours) || (j>=0)) {
+		if (i<netcolours) {
+			p = network[i];
+			visits++;
+			dist = p[1] - g;		/* inx key */
+			if (dist >= stop) i = netcolours;	/* stop iter */
+			else {
+				i++;
+				if (dist<0) dist = -dist;
+				a = p[0] - b;   if (a<0) a = -a;
+				dist += a;
+				if (dist<bestd) {
+					a = p[2] - r;   if (a<0) a = -a;
+					dist += a;
+					if (dist<bestd) {bestd=dist; best=p[3]; stop=bestd-approxeps;}
+				}
+			}
+		}
+		if (j>=0) {
+			p = network[j];
+			visits++;
+			dist = g - p[1]; /* inx key - reverse dif */
+			if (dist >= stop) j = -1; /* stop iter */
+			else {
+				j--;
+				if (dist<0) dist = -dist;
+				a = p[0] - b;   if (a<0) a = -a;
+				dist += a;
+				if (dist<bestd) {
+					a = p[2] - r;   if (a<0) a = -a;
+					dist += a;
+					if (dist<bestd) {bestd=dist; best=p[3]; stop=bestd-approxeps;}
+				}
+			}
+		}
+	}
+	searchqueries++;
+	searchvisits += visits;
+	return(best);
+}
 
-/* Move adjacent neurons by precomputed alpha*(1-((i-j)^2/[r]^2)) in radpower[|i-j|]
-   --------------------------------------------------------------------------------- */
 
-void alterneigh(int rad, int i, register int b, register int g, register int r)
+/* Select the extra L1 error allowed by approxsearch
+   ------------------------------------------------- */
+
+void setapprox(int eps)
 {
-	register int j,k,lo,hi,a;
-	register int *p, *q;
+	approxeps = (eps > 0) ? eps : 0;
+}
 
-	lo = i-rad;   if (lo<-1) lo=-1;
-	hi = i+rad;   if (hi>netsize) hi=netsize;
 
-	j = i+1;
-	k = i-1;
-	q = radpower;
-	while ((j<hi) || (k>lo)) {
-		a = (*(++q));
-		if (j<hi) {
-//		  printf("New point %d: ", j);
-			p = network[j];
-			*p -= (a*(*p - b)) / alpharadbias;
-//		  printf("%f, ", *p / 16.0);
-			p++;
-			*p -= (a*(*p - g)) / alpharadbias;
-//		  printf("%f, ", *p / 16.0);
-			p++;
-			*p -= (a*(*p - r)) / alpharadbias;
-//		  printf("%f\n", *p / 16.0);
-			j++;
+/* Build a k-d tree over the unbiased network (median splits, widest axis)
+   ----------------------------------------------------------------------- */
+
+static int kdpoint[netsize][4];			/* BGRc in tree order */
+static int kdaxis[kdnodes];			/* split axis of node (root 1) */
+static int kdsplit[kdnodes];			/* split value of node */
+
+static threadlocal int kdquery[3];		/* state of the current search */
+static threadlocal int kdbestd,kdbest,kdvisits;
+
+static void kdbuildrange(int node, int lo, int hi)
+{
+	register int i,j,axis,mid;
+	int min[3],max[3],t[4];
+
+	if (hi-lo <= kdleafsize) return;
+	for (j=0; j<3; j++) min[j] = max[j] = kdpoint[lo][j];
+	for (i=lo+1; i<hi; i++)
+		for (j=0; j<3; j++) {
+			if (kdpoint[i][j] < min[j]) min[j] = kdpoint[i][j];
+			if (kdpoint[i][j] > max[j]) max[j] = kdpoint[i][j];
 		}
-		if (k>lo) {
-//      printf("New point %d: ", k);
-			p = network[k];
-			*p -= (a*(*p - b)) / alpharadbias;
-//      printf("%f, ", *p / 16.0);
-			p++;
-			*p -= (a*(*p - g)) / alpharadbias;
-//      printf("%f, ", *p / 16.0);
-			p++;
-			*p -= (a*(*p - r)) / alpharadbias;
-//      printf("%f\n", *p / 16.0);
-			k--;
+	axis = 0;
+	for (j=1; j<3; j++) if (max[j]-min[j] > max[axis]-min[axis]) axis = j;
+
+	/* insertion sort of lo..hi-1 on axis */
+	for (i=lo+1; i<hi; i++) {
+		memcpy(t, kdpoint[i], sizeof(t));
+		for (j=i-1; j>=lo && kdpoint[j][axis] > t[axis]; j--)
+			memcpy(kdpoint[j+1], kdpoint[j], sizeof(t));
+		memcpy(kdpoint[j+1], t, sizeof(t));
+	}
+	mid = (lo+hi)>>1;
+	kdaxis[node] = axis;
+	kdsplit[node] = kdpoint[mid][axis];	/* lo..mid-1 <= split <= mid..hi-1 */
+	kdbuildrange(2*node, lo, mid);
+	kdbuildrange(2*node+1, mid, hi);
+}
+
+static void kdbuild()
+{
+	memcpy(kdpoint, network, sizeof(kdpoint));
+	kdbuildrange(1, 0, netcolours);
+}
+
+
+/* Search the k-d tree, pruning on the L1 distance to each cell
+   ------------------------------------------------------------ */
+
+static void kdsearchrange(int node, int lo, int hi, int rd, int *off)
+{
+	register int i,dist,a,axis,diff,old;
+	register int *p;
+	int mid;
+
+	if (hi-lo <= kdleafsize) {
+		for (i=lo; i<hi; i++) {
+			p = kdpoint[i];
+			kdvisits++;
+			dist = p[1] - kdquery[1];   if (dist<0) dist = -dist;
+			if (dist >= kdbestd) continue;
+			a = p[0] - kdquery[0];   if (a<0) a = -a;
+			dist += a;
+			if (dist >= kdbestd) continue;
+			a = p[2] - kdquery[2];   if (a<0) a = -a;
+			dist += a;
+			if (dist<kdbestd) {kdbestd=dist; kdbest=p[3];}
+		}
+		return;
+	}
+	axis = kdaxis[node];
+	diff = kdquery[axis] - kdsplit[node];
+	mid = (lo+hi)>>1;
+	old = off[axis];
+	if (diff < 0) {
+		kdsearchrange(2*node, lo, mid, rd, off);
+		rd += -diff - old;		/* far cell is at least -diff away on axis */
+		if (rd < kdbestd) {
+			off[axis] = -diff;
+			kdsearchrange(2*node+1, mid, hi, rd, off);
+			off[axis] = old;
+		}
+	}
+	else {
+		kdsearchrange(2*node+1, mid, hi, rd, off);
+		rd += diff - old;
+		if (rd < kdbestd) {
+			off[axis] = diff;
+			kdsearchrange(2*node, lo, mid, rd, off);
+			off[axis] = old;
 		}
 	}
 }
 
+int kdsearch(int b, int g, int r)
+{
+	int off[3];
 
-/* Main Learning Loop
-   ------------------ */
+	kdquery[0] = b;
+	kdquery[1] = g;
+	kdquery[2] = r;
+	kdbestd = 1000;		/* biggest possible dist is 256*3 */
+	kdbest = -1;
+	kdvisits = 0;
+	off[0] = off[1] = off[2] = 0;
+	kdsearchrange(1, 0, netcolours, 0, off);
+	searchqueries++;
+	searchvisits += kdvisits;
+	return(kdbest);
+}
 
-void learn()
+
+/* Sort the network on its projection onto an axis (weights at most axisscale)
+   --------------------------------------------------------------------------- */
+
+static int axisnet[netsize][4];			/* BGRc sorted on key */
+static int axiskey[netsize];			/* projection of each entry */
+static int axisw[3];				/* axis weights */
+
+static void axissort(const int *w)
+{
+	register int i,j,k;
+	int t[4];
+
+	memcpy(axisw, w, sizeof(axisw));
+	memcpy(axisnet, network, sizeof(axisnet));
+	for (i=0; i<netcolours; i++) {
+		memcpy(t, axisnet[i], sizeof(t));
+		k = w[0]*t[0] + w[1]*t[1] + w[2]*t[2];
+		for (j=i-1; j>=0 && axiskey[j] > k; j--) {
+			memcpy(axisnet[j+1], axisnet[j], sizeof(t));
+			axiskey[j+1] = axiskey[j];
+		}
+		memcpy(axisnet[j+1], t, sizeof(t));
+		axiskey[j+1] = k;
+	}
+}
+
+
+/* Search outwards from the projected key, as inxsearch does on g
+   -------------------------------------------------------------- */
+
+int axissearch(int b, int g, int r)
+{
+	register int i,j,dist,a,bestd,bound;
+	register int *p;
+	int best,key,lo,hi,visits;
+
+	key = axisw[0]*b + axisw[1]*g + axisw[2]*r;
+	lo = 0;
+	hi = netcolours;
+	while (lo < hi) {			/* first entry with key >= key */
+		i = (lo+hi)>>1;
+		if (axiskey[i] < key) lo = i+1;
+		else hi = i;
+	}
+
+	/* |key difference| <= axisscale * L1 distance, so the walk */
+	/* can stop once the key difference reaches axisscale*bestd */
+	bestd = 1000;		/* biggest possible dist is 256*3 */
+	bound = axisscale*bestd;
+	best = -1;
+	visits = 0;
+	i = lo;
+	j = i-1;
+	while ((i<netcolours) || (j>=0)) {
+		if (i<netcolours) {
+			if (axiskey[i] - key >= bound) i = netcolours;	/* stop iter */
+			else {
+				p = axisnet[i++];
+				visits++;
+				dist = p[0] - b;   if (dist<0) dist = -dist;
+				a = p[1] - g;   if (a<0) a = -a;
+				dist += a;
+				if (dist<bestd) {
+					a = p[2] - r;   if (a<0) a = -a;
+					dist += a;
+					if (dist<bestd) {bestd=dist; best=p[3]; bound=axisscale*bestd;}
+				}
+			}
+		}
+		if (j>=0) {
+			if (key - axiskey[j] >= bound) j = -1;	/* stop iter */
+			else {
+				p = axisnet[j--];
+				visits++;
+				dist = p[0] - b;   if (dist<0) dist = -dist;
+				a = p[1] - g;   if (a<0) a = -a;
+				dist += a;
+				if (dist<bestd) {
+					a = p[2] - r;   if (a<0) a = -a;
+					dist += a;
+					if (dist<bestd) {bestd=dist; best=p[3]; bound=axisscale*bestd;}
+				}
+			}
+		}
+	}
+	searchqueries++;
+	searchvisits += visits;
+	return(best);
+}
+
+
+/* Choose among b, g, r, grey and principal axes by probe count
+   ------------------------------------------------------------ */
+
+static void axisbuild()
+{
+	int cand[axiscands][3];
+	double mean[3],cov[3][3],v[3],u[3],m;
+	int i,j,k,c,best,q,probe[3];
+	long visits,bestvisits;
+	register int *p;
+
+	/* principal axis of the palette by power iteration */
+	for (j=0; j<3; j++) mean[j] = 0;
+	for (i=0; i<netcolours; i++)
+		for (j=0; j<3; j++) mean[j] += network[i][j];
+	for (j=0; j<3; j++) mean[j] /= netcolours;
+	for (j=0; j<3; j++)
+		for (k=0; k<3; k++) cov[j][k] = 0;
+	for (i=0; i<netcolours; i++)
+		for (j=0; j<3; j++)
+			for (k=0; k<3; k++)
+				cov[j][k] += (network[i][j]-mean[j])*(network[i][k]-mean[k]);
+	v[0] = v[1] = v[2] = 1;
+	for (c=0; c<32; c++) {
+		for (j=0; j<3; j++) u[j] = cov[j][0]*v[0] + cov[j][1]*v[1] + cov[j][2]*v[2];
+		m = 0;
+		for (j=0; j<3; j++) if (u[j] > m || -u[j] > m) m = (u[j] < 0) ? -u[j] : u[j];
+		if (m == 0) break;
+		for (j=0; j<3; j++) v[j] = u[j]/m;
+	}
+
+	for (c=0; c<axiscands; c++)
+		for (j=0; j<3; j++) cand[c][j] = (c == j || c == 3) ? axisscale : 0;
+	m = 0;
+	for (j=0; j<3; j++) if (v[j] > m || -v[j] > m) m = (v[j] < 0) ? -v[j] : v[j];
+	for (j=0; j<3; j++) cand[4][j] = (m > 0) ? (int) (axisscale*v[j]/m + ((v[j] < 0) ? -0.5 : 0.5)) : axisscale;
+
+	/* probe with jittered palette colours, typical of pixels mapped */
+	best = 0;
+	bestvisits = -1;
+	for (c=0; c<axiscands; c++) {
+		axissort(cand[c]);
+		visits = searchvisits;
+		for (i=0; i<netcolours; i++) {
+			p = network[i];
+			for (j=0; j<3; j++) {
+				q = ((i+j) & 1) ? p[j]+axisjitter : p[j]-axisjitter;
+				probe[j] = (q < 0) ? 0 : (q > 255) ? 255 : q;
+			}
+			axissearch(probe[0], probe[1], probe[2]);
+		}
+		visits = searchvisits - visits;
+		if (bestvisits < 0 || visits < bestvisits) {
+			bestvisits = visits;
+			best = c;
+		}
+	}
+	axissort(cand[best]);
+}
+
+
+/* Build a grid over BGR space listing, for each cell, every colour that can
+   be nearest to some point in it
+   ------------------------------------------------------------------------- */
+
+static unsigned char gridpal[netsize][4];	/* BGR by colour number */
+static int gridstart[gridcells+1];		/* list of cell k at gridstart[k] */
+static unsigned char *gridlist;			/* candidate colour numbers */
+static int gridmaxlist;				/* longest list */
+static int gridfailed;				/* out of memory: netsearch skips the grid */
+
+static void gridbuild()
+{
+	int k,i,j,lo,hi,upper,mind,maxd,count,size;
+	int mindist[netsize];
+	register int *p;
+	unsigned char *grown;
+
+	for (i=0; i<netcolours; i++) {
+		p = network[i];
+		for (j=0; j<3; j++) gridpal[p[3]][j] = p[j];
+	}
+	size = 8*gridcells;
+	free(gridlist);
+	gridlist = (unsigned char *) malloc(size);
+	gridfailed = (gridlist == NULL);
+	if (gridfailed) return;
+	count = 0;
+	gridmaxlist = 0;
+
+	for (k=0; k<gridcells; k++) {
+		/* any point of the cell is within upper of some colour, */
+		/* so colours further than upper from the whole cell lose */
+		upper = 1000;
+		for (i=0; i<netcolours; i++) {
+			mind = maxd = 0;
+			for (j=0; j<3; j++) {
+				lo = ((k >> (gridshift*(2-j))) & (gridside-1)) << gridshift;
+				hi = lo + (1 << gridshift) - 1;
+				if (gridpal[i][j] < lo) mind += lo - gridpal[i][j];
+				if (gridpal[i][j] > hi) mind += gridpal[i][j] - hi;
+				maxd += (gridpal[i][j] - lo > hi - gridpal[i][j]) ? gridpal[i][j] - lo : hi - gridpal[i][j];
+			}
+			mindist[i] = mind;
+			if (maxd < upper) upper = maxd;
+		}
+		gridstart[k] = count;
+		for (i=0; i<netcolours; i++) {
+			if (mindist[i] > upper) continue;
+			if (count == size) {
+				size *= 2;
+				grown = (unsigned char *) realloc(gridlist, size);
+				if (grown == NULL) {gridfailed = 1; return;}
+				gridlist = grown;
+			}
+			gridlist[count++] = i;
+		}
+		if (count - gridstart[k] > gridmaxlist) gridmaxlist = count - gridstart[k];
+	}
+	gridstart[gridcells] = count;
+}
+
+
+/* Search only the candidates of the grid cell holding (b,g,r)
+   ----------------------------------------------------------- */
+
+int gridsearch(int b, int g, int r)
 {
-	register int i,j,b,g,r;
-	int radius,rad,alpha,step,delta,samplepixels;
+	register int i,dist,a,bestd;
 	register unsigned char *p;
-	unsigned char *lim;
+	int k,best,end;
 
-	alphadec = 30 + ((samplefac-1)/3);
-	p = thepicture;
-	lim = thepicture + lengthcount;
-	samplepixels = lengthcount/(3*samplefac);
-	delta = samplepixels/ncycles;
-	alpha = initalpha;
-	radius = initradius;
-	
-	rad = radius >> radiusbiasshift;
-	if (rad <= 1) rad = 0;
-	for (i=0; i<rad; i++) 
-		radpower[i] = alpha*(((rad*rad - i*i)*radbias)/(rad*rad));
-	
-//	fprintf(stderr,"beginning 1D learning: initial radius=%d\n", rad);
+	k = ((b >> gridshift) << (2*gridshift)) | ((g >> gridshift) << gridshift) | (r >> gridshift);
+	bestd = 1000;		/* biggest possible dist is 256*3 */
+	best = -1;
+	end = gridstart[k+1];
+	for (i=gridstart[k]; i<end; i++) {
+		p = gridpal[gridlist[i]];
+		dist = p[1] - g;   if (dist<0) dist = -dist;
+		if (dist<bestd) {
+			a = p[0] - b;   if (a<0) a = -a;
+			dist += a;
+			if (dist<bestd) {
+				a = p[2] - r;   if (a<0) a = -a;
+				dist += a;
+				if (dist<bestd) {bestd=dist; best=gridlist[i];}
+			}
+		}
+	}
+	searchqueries++;
+	searchvisits += end - gridstart[k];
+	return(best);
+}
 
-	if ((lengthcount%prime1) != 0) step = 3*prime1;
-	else {
-		if ((lengthcount%prime2) !=0) step = 3*prime2;
-		else {
-			if ((lengthcount%prime3) !=0) step = 3*prime3;
-			else step = 3*prime4;
+
+/* Return the longest grid candidate list (the worst-case search cost)
+   ------------------------------------------------------------------- */
+
+int getgridmaxlist()
+{
+	return gridmaxlist;
+}
+
+
+/* Group the colours around a few k-means centroids, keeping each group's
+   bounding box so whole groups can be ruled out at once
+   ---------------------------------------------------------------------- */
+
+static unsigned char clusterpal[netsize][4];	/* BGRc, grouped by cluster */
+static int clusterstart[clusters+1];		/* cluster k at clusterstart[k] */
+static int clustercentre[clusters][3];		/* BGR centroid */
+static unsigned short clusterlo[3][clusters];	/* BGR bounding box planes */
+static unsigned short clusterhi[3][clusters];
+
+static int clusternearest(register int *p)
+{
+	register int k,j,dist,a,bestd;
+	int best;
+
+	bestd = 1000;
+	best = 0;
+	for (k=0; k<clusters; k++) {
+		dist = 0;
+		for (j=0; j<3; j++) {
+			a = p[j] - clustercentre[k][j];   if (a<0) a = -a;
+			dist += a;
 		}
+		if (dist<bestd) {bestd=dist; best=k;}
 	}
-	
-	i = 0;
-	while (i < samplepixels) {
-		b = p[0] << netbiasshift;
-		g = p[1] << netbiasshift;
-		r = p[2] << netbiasshift;
-		j = contest(b,g,r);
+	return(best);
+}
 
-		altersingle(alpha,j,b,g,r);
-		if (rad) alterneigh(rad,j,b,g,r);   /* alter neighbours */
+static void clusterbuild()
+{
+	int i,j,k,it,dist,a,far,fard;
+	int owner[netsize],count[clusters],sum[clusters][3];
+	int seedd[netsize];
+	register int *p;
 
-		p += step;
-		if (p >= lim) p -= lengthcount;
-	
-		i++;
-		if (i%delta == 0) {	
-			alpha -= alpha / alphadec;
-			radius -= radius / radiusdec;
-			rad = radius >> radiusbiasshift;
-			if (rad <= 1) rad = 0;
-			for (j=0; j<rad; j++) 
-				radpower[j] = alpha*(((rad*rad - j*j)*radbias)/(rad*rad));
+	/* farthest-point seeds spread the centroids over the palette */
+	for (j=0; j<3; j++) clustercentre[0][j] = network[netcolours>>1][j];
+	for (i=0; i<netcolours; i++) seedd[i] = 1000;
+	for (k=1; k<clusters; k++) {
+		far = 0;
+		fard = -1;
+		for (i=0; i<netcolours; i++) {
+			dist = 0;
+			for (j=0; j<3; j++) {
+				a = network[i][j] - clustercentre[k-1][j];   if (a<0) a = -a;
+				dist += a;
+			}
+			if (dist < seedd[i]) seedd[i] = dist;
+			if (seedd[i] > fard) {fard = seedd[i]; far = i;}
 		}
+		for (j=0; j<3; j++) clustercentre[k][j] = network[far][j];
 	}
-//	fprintf(stderr,"finished 1D learning: final alpha=%f !\n",((float)alpha)/initalpha);
+
+	for (it=0; it<clusteriters; it++) {
+		for (k=0; k<clusters; k++) count[k] = sum[k][0] = sum[k][1] = sum[k][2] = 0;
+		for (i=0; i<netcolours; i++) {
+			k = owner[i] = clusternearest(network[i]);
+			count[k]++;
+			for (j=0; j<3; j++) sum[k][j] += network[i][j];
+		}
+		for (k=0; k<clusters; k++)
+			if (count[k]) for (j=0; j<3; j++) clustercentre[k][j] = (sum[k][j] + (count[k]>>1)) / count[k];
+	}
+
+	/* lay the clusters out contiguously and bound each one */
+	for (k=0; k<clusters; k++) count[k] = 0;
+	for (i=0; i<netcolours; i++) count[owner[i] = clusternearest(network[i])]++;
+	clusterstart[0] = 0;
+	for (k=0; k<clusters; k++) {
+		clusterstart[k+1] = clusterstart[k] + count[k];
+		count[k] = clusterstart[k];
+		for (j=0; j<3; j++) {
+			clusterlo[j][k] = 255;
+			clusterhi[j][k] = 0;
+		}
+	}
+	for (i=0; i<netcolours; i++) {
+		p = network[i];
+		k = owner[i];
+		for (j=0; j<4; j++) clusterpal[count[k]][j] = p[j];
+		count[k]++;
+		for (j=0; j<3; j++) {
+			if (p[j] < clusterlo[j][k]) clusterlo[j][k] = p[j];
+			if (p[j] > clusterhi[j][k]) clusterhi[j][k] = p[j];
+		}
+	}
+}
+
+
+/* Search the clusters nearest first, skipping any whose bounding box is
+   no closer than the best colour found so far
+   --------------------------------------------------------------------- */
+
+int clustersearch(int b, int g, int r)
+{
+	register int i,dist,a,bestd;
+	register unsigned char *p;
+	int k,m,first,end,best,visits;
+	unsigned short bound[clusters];
+#if defined(batchsimd) && defined(__SSE2__)
+	__m128i qb,qg,qr,d;
+#endif
+
+	/* L1 distance from (b,g,r) to each box; the nearest box goes first */
+#if defined(batchsimd) && defined(__SSE2__)
+	qb = _mm_set1_epi16(b);
+	qg = _mm_set1_epi16(g);
+	qr = _mm_set1_epi16(r);
+	for (k=0; k<clusters; k+=8) {
+		d = _mm_add_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i *) (clusterlo[0]+k)), qb),
+			_mm_subs_epu16(qb, _mm_loadu_si128((const __m128i *) (clusterhi[0]+k))));
+		d = _mm_add_epi16(d, _mm_add_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i *) (clusterlo[1]+k)), qg),
+			_mm_subs_epu16(qg, _mm_loadu_si128((const __m128i *) (clusterhi[1]+k)))));
+		d = _mm_add_epi16(d, _mm_add_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i *) (clusterlo[2]+k)), qr),
+			_mm_subs_epu16(qr, _mm_loadu_si128((const __m128i *) (clusterhi[2]+k)))));
+		_mm_storeu_si128((__m128i *) (bound+k), d);
+	}
+#else
+	for (k=0; k<clusters; k++) {
+		dist = 0;
+		a = clusterlo[0][k] - b;   if (a>0) dist += a;
+		a = b - clusterhi[0][k];   if (a>0) dist += a;
+		a = clusterlo[1][k] - g;   if (a>0) dist += a;
+		a = g - clusterhi[1][k];   if (a>0) dist += a;
+		a = clusterlo[2][k] - r;   if (a>0) dist += a;
+		a = r - clusterhi[2][k];   if (a>0) dist += a;
+		bound[k] = dist;
+	}
+#endif
+	first = 0;
+	for (k=1; k<clusters; k++) if (bound[k] < bound[first]) first = k;
+
+	bestd = 1000;		/* biggest possible dist is 256*3 */
+	best = -1;
+	visits = 0;
+	for (m=-1; m<clusters; m++) {
+		k = (m < 0) ? first : m;
+		if (bound[k] >= bestd || (m >= 0 && k == first)) continue;
+		end = clusterstart[k+1];
+		visits += end - clusterstart[k];
+		for (i=clusterstart[k]; i<end; i++) {
+			p = clusterpal[i];
+			dist = p[1] - g;   if (dist<0) dist = -dist;
+			if (dist<bestd) {
+				a = p[0] - b;   if (a<0) a = -a;
+				dist += a;
+				if (dist<bestd) {
+					a = p[2] - r;   if (a<0) a = -a;
+					dist += a;
+					if (dist<bestd) {bestd=dist; best=p[3];}
+				}
+			}
+		}
+	}
+	searchqueries++;
+	searchvisits += visits;
+	return(best);
+}
+
+
+/* Tabulate the nearest colour of every BGR value, in memory or mapped from
+   a file shared by every process quantizing to the same palette
+   ------------------------------------------------------------------------ */
+
+typedef struct {
+	char magic[8];				/* lutmagic */
+	unsigned long long key;			/* palettehash of colours */
+	int colours;				/* netcolours */
+	int distance;				/* metricl1 or metricl2 */
+	unsigned char colourmap[3*netsize];	/* BGR by colour number */
+} lutheader;
+
+static const unsigned char *lut;		/* colour number by (b<<16)|(g<<8)|r */
+static void *lutbase;				/* file mapping holding lut, or NULL */
+static size_t lutbytes;
+
+static void lutfree()
+{
+	if (lutbase) munmap(lutbase, lutbytes);
+	else free((void *) lut);
+	lut = NULL;
+	lutbase = NULL;
+}
+
+static int lutbuild()
+{
+	int b,g,r;
+	unsigned char row[3*256];
+	unsigned char *q;
+
+	lutfree();
+	q = (unsigned char *) malloc(lutentries);
+	if (q == NULL) return -1;		/* lut stays NULL: netsearch skips it */
+	lut = q;
+
+	/* rows of 256 reds through the vector kernels (after batchbuild) */
+	for (b=0; b<256; b++)
+		for (g=0; g<256; g++) {
+			for (r=0; r<256; r++) {
+				row[3*r] = b;
+				row[3*r+1] = g;
+				row[3*r+2] = r;
+			}
+			batchsearch(row, 256, q);
+			q += 256;
+		}
+	searchqueries = searchvisits = 0;
+	return 0;
+}
+
+
+/* Hash a BGR colour map (FNV-1a) to key its lut file
+   -------------------------------------------------- */
+
+static unsigned long long hashcolours(const unsigned char *colourmap, int n)
+{
+	unsigned long long h;
+	int i;
+
+	h = 14695981039346656037ULL;
+	for (i=0; i<3*n; i++) {
+		h ^= colourmap[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+unsigned long long palettehash(const unsigned char *colourmap)
+{
+	return hashcolours(colourmap, netcolours);
+}
+
+
+/* Write the colour map and its lut to filename, replacing it atomically
+   --------------------------------------------------------------------- */
+
+int lutsave(const char *filename)
+{
+	lutheader h;
+	static const char zeros[lutoffset] = {0};
+	char *temp;
+	FILE *f;
+	int ok;
+
+	if (lut == NULL && lutbuild() != 0) return -1;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, lutmagic, sizeof(h.magic));
+	getcolourmap(h.colourmap);
+	h.key = palettehash(h.colourmap);
+	h.colours = netcolours;
+	h.distance = metric;
+
+	/* other processes may be mapping filename, so never rewrite it in place */
+	temp = (char *) malloc(strlen(filename) + 32);
+	if (temp == NULL) return -1;
+	sprintf(temp, "%s.%ld.tmp", filename, (long) getpid());
+	f = fopen(temp, "wb");
+	if (f == NULL) {free(temp); return -1;}
+	ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(zeros, lutoffset - sizeof(h), 1, f) == 1
+		&& fwrite(lut, lutentries, 1, f) == 1;
+	ok = (fclose(f) == 0) && ok;
+	if (ok) ok = (rename(temp, filename) == 0);
+	if (!ok) remove(temp);
+	free(temp);
+	return ok ? 0 : -1;
+}
+
+
+/* Map a lut file read-only and shared, and search with it
+   ------------------------------------------------------- */
+
+int lutload(const char *filename, unsigned long long key, unsigned char *colourmap)
+{
+	const lutheader *h;
+	struct stat st;
+	void *base;
+	int i,j,fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || st.st_size != lutoffset + lutentries) {close(fd); return -1;}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return -1;
+
+	h = (const lutheader *) base;
+	if (memcmp(h->magic, lutmagic, sizeof(h->magic)) != 0 || h->colours < 2 || h->colours > netsize
+	    || h->distance != metric || h->key != hashcolours(h->colourmap, h->colours)
+	    || (key != 0 && h->key != key)) {
+		munmap(base, st.st_size);
+		return -1;
+	}
+	/* the palette becomes the network, indexed and in the batch planes */
+	netcolours = h->colours;
+	for (i=0; i<netcolours; i++) {
+		for (j=0; j<3; j++) network[i][j] = h->colourmap[3*i+j];
+		network[i][3] = i;
+	}
+	searchmode = searchgreen;
+	inxbuild();				/* also frees any older lut */
+	lutbase = base;
+	lutbytes = st.st_size;
+	lut = (const unsigned char *) base + lutoffset;
+	if (colourmap) memcpy(colourmap, h->colourmap, 3*netcolours);
+	searchmode = searchlut;
+	searchqueries = searchvisits = 0;
+	return 0;
+}
+
+
+/* Look up BGR values in the lut (after inxbuild with searchlut or lutload)
+   ------------------------------------------------------------------------ */
+
+int lutsearch(int b, int g, int r)
+{
+	searchqueries++;
+	searchvisits++;
+	return lut[(b << 16) | (g << 8) | r];
+}
+
+
+/* Lay out the sorted network as 16-bit planes for batchsearch
+   ----------------------------------------------------------- */
+
+static short batchb[netsize],batchg[netsize],batchr[netsize];	/* sorted on g */
+static unsigned char batchc[netsize];		/* colour number of each */
+static int batchbg[netsize],batchr0[netsize];	/* (b,g) and (r,0) 16-bit pairs */
+static int batchcount = netsize;		/* entries scanned, a multiple of 32 */
+
+static void batchbuild()
+{
+	int i;
+
+	/* pad small palettes to the widest kernel with colours too far to win */
+	batchcount = (netcolours + 31) & ~31;
+	for (i=0; i<batchcount; i++) {
+		if (i >= netcolours) {
+			batchb[i] = batchg[i] = batchr[i] = batchfar;
+			batchc[i] = 0;
+			batchbg[i] = (batchfar << 16) | batchfar;
+			batchr0[i] = batchfar;
+			continue;
+		}
+		batchb[i] = network[i][0];
+		batchg[i] = network[i][1];
+		batchr[i] = network[i][2];
+		batchc[i] = network[i][3];
+		batchbg[i] = (network[i][1] << 16) | network[i][0];
+		batchr0[i] = network[i][2];
+	}
+}
+
+
+/* Break a distance tie as inxsearch does: it keeps the entry it reaches
+   first walking outwards from netindex[g], i side before j side
+   --------------------------------------------------------------------- */
+
+static void batchpick(int pos, int g, int *bestrank, int *best)
+{
+	register int i0,rank;
+
+	i0 = netindex[g];
+	rank = (pos >= i0) ? 2*(pos-i0) : 2*(i0-pos)-1;	/* visit order */
+	if (rank < *bestrank) {
+		*bestrank = rank;
+		*best = pos;
+	}
+}
+
+#ifdef batchsimd
+
+__attribute__((target("sse4.1")))
+static void batchsse41(const unsigned char *bgr, int n, unsigned char *out)
+{
+	unsigned short dist[batchwidth][netsize];
+	__m128i qb[batchwidth],qg[batchwidth],qr[batchwidth],mn[batchwidth];
+	__m128i pb,pg,pr,d,m;
+	int k,t,c,mask,bit,bestrank,best;
+
+	for (k=0; k+batchwidth<=n; k+=batchwidth, bgr+=3*batchwidth) {
+		for (t=0; t<batchwidth; t++) {
+			qb[t] = _mm_set1_epi16(bgr[3*t]);
+			qg[t] = _mm_set1_epi16(bgr[3*t+1]);
+			qr[t] = _mm_set1_epi16(bgr[3*t+2]);
+			mn[t] = _mm_set1_epi16(-1);
+		}
+		for (c=0; c<batchcount; c+=8) {
+			pb = _mm_loadu_si128((const __m128i *) (batchb+c));
+			pg = _mm_loadu_si128((const __m128i *) (batchg+c));
+			pr = _mm_loadu_si128((const __m128i *) (batchr+c));
+			for (t=0; t<batchwidth; t++) {
+				d = _mm_add_epi16(_mm_abs_epi16(_mm_sub_epi16(pb, qb[t])),
+					_mm_add_epi16(_mm_abs_epi16(_mm_sub_epi16(pg, qg[t])),
+					_mm_abs_epi16(_mm_sub_epi16(pr, qr[t]))));
+				_mm_storeu_si128((__m128i *) (dist[t]+c), d);
+				mn[t] = _mm_min_epu16(mn[t], d);
+			}
+		}
+		for (t=0; t<batchwidth; t++) {
+			m = _mm_set1_epi16(_mm_extract_epi16(_mm_minpos_epu16(mn[t]), 0));
+			bestrank = 2*netsize;
+			best = 0;
+			for (c=0; c<batchcount; c+=8) {
+				mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) (dist[t]+c)), m));
+				for (; mask; mask &= mask-1)
+					if (!((bit = __builtin_ctz(mask)) & 1))
+						batchpick(c+(bit>>1), bgr[3*t+1], &bestrank, &best);
+			}
+			out[k+t] = batchc[best];
+		}
+	}
+	for (; k<n; k++, bgr+=3) out[k] = inxsearch(bgr[0], bgr[1], bgr[2]);
+}
+
+__attribute__((target("avx2")))
+static void batchavx2(const unsigned char *bgr, int n, unsigned char *out)
+{
+	unsigned short dist[batchwidth][netsize];
+	__m256i qb[batchwidth],qg[batchwidth],qr[batchwidth],mn[batchwidth];
+	__m256i pb,pg,pr,d,m;
+	__m128i h;
+	int k,t,c,mask,bit,bestrank,best;
+
+	for (k=0; k+batchwidth<=n; k+=batchwidth, bgr+=3*batchwidth) {
+		for (t=0; t<batchwidth; t++) {
+			qb[t] = _mm256_set1_epi16(bgr[3*t]);
+			qg[t] = _mm256_set1_epi16(bgr[3*t+1]);
+			qr[t] = _mm256_set1_epi16(bgr[3*t+2]);
+			mn[t] = _mm256_set1_epi16(-1);
+		}
+		for (c=0; c<batchcount; c+=16) {
+			pb = _mm256_loadu_si256((const __m256i *) (batchb+c));
+			pg = _mm256_loadu_si256((const __m256i *) (batchg+c));
+			pr = _mm256_loadu_si256((const __m256i *) (batchr+c));
+			for (t=0; t<batchwidth; t++) {
+				d = _mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(pb, qb[t])),
+					_mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(pg, qg[t])),
+					_mm256_abs_epi16(_mm256_sub_epi16(pr, qr[t]))));
+				_mm256_storeu_si256((__m256i *) (dist[t]+c), d);
+				mn[t] = _mm256_min_epu16(mn[t], d);
+			}
+		}
+		for (t=0; t<batchwidth; t++) {
+			h = _mm_min_epu16(_mm256_castsi256_si128(mn[t]), _mm256_extracti128_si256(mn[t], 1));
+			m = _mm256_set1_epi16(_mm_extract_epi16(_mm_minpos_epu16(h), 0));
+			bestrank = 2*netsize;
+			best = 0;
+			for (c=0; c<batchcount; c+=16) {
+				mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *) (dist[t]+c)), m));
+				for (; mask; mask &= mask-1)
+					if (!((bit = __builtin_ctz(mask)) & 1))
+						batchpick(c+(bit>>1), bgr[3*t+1], &bestrank, &best);
+			}
+			out[k+t] = batchc[best];
+		}
+	}
+	for (; k<n; k++, bgr+=3) out[k] = inxsearch(bgr[0], bgr[1], bgr[2]);
+}
+
+__attribute__((target("avx512bw")))
+static void batchavx512(const unsigned char *bgr, int n, unsigned char *out)
+{
+	unsigned short dist[batchwidth][netsize];
+	__m512i qb[batchwidth],qg[batchwidth],qr[batchwidth],mn[batchwidth];
+	__m512i pb,pg,pr,d,m;
+	__m256i y;
+	__m128i h;
+	unsigned int mask;
+	int k,t,c,bestrank,best;
+
+	for (k=0; k+batchwidth<=n; k+=batchwidth, bgr+=3*batchwidth) {
+		for (t=0; t<batchwidth; t++) {
+			qb[t] = _mm512_set1_epi16(bgr[3*t]);
+			qg[t] = _mm512_set1_epi16(bgr[3*t+1]);
+			qr[t] = _mm512_set1_epi16(bgr[3*t+2]);
+			mn[t] = _mm512_set1_epi16(-1);
+		}
+		for (c=0; c<batchcount; c+=32) {
+			pb = _mm512_loadu_si512((const void *) (batchb+c));
+			pg = _mm512_loadu_si512((const void *) (batchg+c));
+			pr = _mm512_loadu_si512((const void *) (batchr+c));
+			for (t=0; t<batchwidth; t++) {
+				d = _mm512_add_epi16(_mm512_abs_epi16(_mm512_sub_epi16(pb, qb[t])),
+					_mm512_add_epi16(_mm512_abs_epi16(_mm512_sub_epi16(pg, qg[t])),
+					_mm512_abs_epi16(_mm512_sub_epi16(pr, qr[t]))));
+				_mm512_storeu_si512((void *) (dist[t]+c), d);
+				mn[t] = _mm512_min_epu16(mn[t], d);
+			}
+		}
+		for (t=0; t<batchwidth; t++) {
+			/* zero-masked extracts: the unmasked ones pass GCC an undefined source */
+			y = _mm256_min_epu16(_mm512_maskz_extracti64x4_epi64(0xf, mn[t], 0), _mm512_maskz_extracti64x4_epi64(0xf, mn[t], 1));
+			h = _mm_min_epu16(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+			m = _mm512_set1_epi16(_mm_extract_epi16(_mm_minpos_epu16(h), 0));
+			bestrank = 2*netsize;
+			best = 0;
+			for (c=0; c<batchcount; c+=32) {
+				mask = _mm512_cmpeq_epi16_mask(_mm512_loadu_si512((const void *) (dist[t]+c)), m);
+				for (; mask; mask &= mask-1)
+					batchpick(c+__builtin_ctz(mask), bgr[3*t+1], &bestrank, &best);
+			}
+			out[k+t] = batchc[best];
+		}
+	}
+	for (; k<n; k++, bgr+=3) out[k] = inxsearch(bgr[0], bgr[1], bgr[2]);
+}
+
+/* squared distances: pmaddwd squares and adds the b and g differences of */
+/* a (b,g) pair in one step, and the r difference of an (r,0) pair in another */
+
+__attribute__((target("sse4.1")))
+static void batchl2sse41(const unsigned char *bgr, int n, unsigned char *out)
+{
+	unsigned int dist[batchwidth][netsize];
+	__m128i qbg[batchwidth],qr[batchwidth],mn[batchwidth];
+	__m128i pbg,pr,d,e,m;
+	int k,t,c,mask,bestrank,best;
+
+	for (k=0; k+batchwidth<=n; k+=batchwidth, bgr+=3*batchwidth) {
+		for (t=0; t<batchwidth; t++) {
+			qbg[t] = _mm_set1_epi32((bgr[3*t+1] << 16) | bgr[3*t]);
+			qr[t] = _mm_set1_epi32(bgr[3*t+2]);
+			mn[t] = _mm_set1_epi32(-1);
+		}
+		for (c=0; c<batchcount; c+=4) {
+			pbg = _mm_loadu_si128((const __m128i *) (batchbg+c));
+			pr = _mm_loadu_si128((const __m128i *) (batchr0+c));
+			for (t=0; t<batchwidth; t++) {
+				d = _mm_sub_epi16(pbg, qbg[t]);
+				e = _mm_sub_epi16(pr, qr[t]);
+				d = _mm_add_epi32(_mm_madd_epi16(d, d), _mm_madd_epi16(e, e));
+				_mm_storeu_si128((__m128i *) (dist[t]+c), d);
+				mn[t] = _mm_min_epu32(mn[t], d);
+			}
+		}
+		for (t=0; t<batchwidth; t++) {
+			m = _mm_min_epu32(mn[t], _mm_shuffle_epi32(mn[t], 0x4e));
+			m = _mm_min_epu32(m, _mm_shuffle_epi32(m, 0xb1));
+			bestrank = 2*netsize;
+			best = 0;
+			for (c=0; c<batchcount; c+=4) {
+				mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (dist[t]+c)), m)));
+				for (; mask; mask &= mask-1)
+					batchpick(c+__builtin_ctz(mask), bgr[3*t+1], &bestrank, &best);
+			}
+			out[k+t] = batchc[best];
+		}
+	}
+	for (; k<n; k++, bgr+=3) out[k] = l2search(bgr[0], bgr[1], bgr[2]);
+}
+
+__attribute__((target("avx2")))
+static void batchl2avx2(const unsigned char *bgr, int n, unsigned char *out)
+{
+	unsigned int dist[batchwidth][netsize];
+	__m256i qbg[batchwidth],qr[batchwidth],mn[batchwidth];
+	__m256i pbg,pr,d,e,m;
+	__m128i h;
+	int k,t,c,mask,bestrank,best;
+
+	for (k=0; k+batchwidth<=n; k+=batchwidth, bgr+=3*batchwidth) {
+		for (t=0; t<batchwidth; t++) {
+			qbg[t] = _mm256_set1_epi32((bgr[3*t+1] << 16) | bgr[3*t]);
+			qr[t] = _mm256_set1_epi32(bgr[3*t+2]);
+			mn[t] = _mm256_set1_epi32(-1);
+		}
+		for (c=0; c<batchcount; c+=8) {
+			pbg = _mm256_loadu_si256((const __m256i *) (batchbg+c));
+			pr = _mm256_loadu_si256((const __m256i *) (batchr0+c));
+			for (t=0; t<batchwidth; t++) {
+				d = _mm256_sub_epi16(pbg, qbg[t]);
+				e = _mm256_sub_epi16(pr, qr[t]);
+				d = _mm256_add_epi32(_mm256_madd_epi16(d, d), _mm256_madd_epi16(e, e));
+				_mm256_storeu_si256((__m256i *) (dist[t]+c), d);
+				mn[t] = _mm256_min_epu32(mn[t], d);
+			}
+		}
+		for (t=0; t<batchwidth; t++) {
+			h = _mm_min_epu32(_mm256_castsi256_si128(mn[t]), _mm256_extracti128_si256(mn[t], 1));
+			h = _mm_min_epu32(h, _mm_shuffle_epi32(h, 0x4e));
+			h = _mm_min_epu32(h, _mm_shuffle_epi32(h, 0xb1));
+			m = _mm256_broadcastd_epi32(h);
+			bestrank = 2*netsize;
+			best = 0;
+			for (c=0; c<batchcount; c+=8) {
+				mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (dist[t]+c)), m)));
+				for (; mask; mask &= mask-1)
+					batchpick(c+__builtin_ctz(mask), bgr[3*t+1], &bestrank, &best);
+			}
+			out[k+t] = batchc[best];
+		}
+	}
+	for (; k<n; k++, bgr+=3) out[k] = l2search(bgr[0], bgr[1], bgr[2]);
+}
+
+#endif
+
+
+/* Map n BGR pixels to colour indices by exhaustive vector search, giving
+   exactly the indices of inxsearch (after inxbuild)
+   ---------------------------------------------------------------------- */
+
+void batchsearch(const unsigned char *bgr, long n, unsigned char *indices)
+{
+	long i;
+
+	/* the kernels count pixels in ints */
+	for (; n > batchspan; n -= batchspan, bgr += 3L*batchspan, indices += batchspan)
+		batchsearch(bgr, batchspan, indices);
+
+	if (metric == metricl2) {
+#ifdef batchsimd
+		if (__builtin_cpu_supports("avx2")) {batchl2avx2(bgr, n, indices); return;}
+		if (__builtin_cpu_supports("sse4.1")) {batchl2sse41(bgr, n, indices); return;}
+#endif
+		for (i=0; i<n; i++, bgr+=3) indices[i] = l2search(bgr[0], bgr[1], bgr[2]);
+		return;
+	}
+#ifdef batchsimd
+	if (__builtin_cpu_supports("avx512bw")) {batchavx512(bgr, n, indices); return;}
+	if (__builtin_cpu_supports("avx2")) {batchavx2(bgr, n, indices); return;}
+	if (__builtin_cpu_supports("sse4.1")) {batchsse41(bgr, n, indices); return;}
+#endif
+	for (i=0; i<n; i++, bgr+=3) indices[i] = inxsearch(bgr[0], bgr[1], bgr[2]);
+}
+
+
+/* Select the index built by inxbuild and used by netsearch
+   -------------------------------------------------------- */
+
+void setsearch(int mode)
+{
+	searchmode = mode;
+}
+
+
+/* Search for BGR values 0..255 with the selected index
+   ---------------------------------------------------- */
+
+int netsearch(int b, int g, int r)
+{
+	if (searchmode == searchlut && lut != NULL) return lutsearch(b,g,r);
+	if (metric == metricl2) return l2search(b,g,r);
+	if (searchmode == searchkdtree) return kdsearch(b,g,r);
+	if (searchmode == searchaxis) return axissearch(b,g,r);
+	if (searchmode == searchgrid && !gridfailed) return gridsearch(b,g,r);
+	if (searchmode == searchapprox) return approxsearch(b,g,r);
+	if (searchmode == searchcluster) return clustersearch(b,g,r);
+	return inxsearch(b,g,r);
+}
+
+
+/* Count leading pixels (up to n) of a equal to the pixels of b
+   ------------------------------------------------------------ */
+
+static int samerun(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i;
+#if defined(batchsimd) && defined(__SSE2__)
+	unsigned long long m;
+#endif
+
+	if (n == 0 || a[0] != b[0] || a[1] != b[1] || a[2] != b[2]) return 0;
+	i = 1;
+#if defined(batchsimd) && defined(__SSE2__)
+	/* 16 pixels per step: compare 48 bytes, find the first differing one */
+	for (; i+16<=n; i+=16) {
+		m = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) (a+3*i)), _mm_loadu_si128((const __m128i *) (b+3*i))));
+		m |= (unsigned long long) (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) (a+3*i+16)), _mm_loadu_si128((const __m128i *) (b+3*i+16)))) << 16;
+		m |= (unsigned long long) (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) (a+3*i+32)), _mm_loadu_si128((const __m128i *) (b+3*i+32)))) << 32;
+		if (m != 0xffffffffffffULL) return i + __builtin_ctzll(~m)/3;
+	}
+#endif
+	for (; i<n; i++)
+		if (a[3*i] != b[3*i] || a[3*i+1] != b[3*i+1] || a[3*i+2] != b[3*i+2]) break;
+	return i;
+}
+
+
+/* Map a row of BGR pixels to colour indices with netsearch, reusing the
+   index of the previous pixel or of the row above (NULL for none) when the
+   colour repeats
+   ------------------------------------------------------------------------ */
+
+static void maprow(const unsigned char *p, const unsigned char *above, unsigned char *q, const unsigned char *qabove, int width)
+{
+	int x,k;
+
+	for (x=0; x<width; ) {
+		if (x > 0 && (k = samerun(p+3*x, p+3*x-3, width-x))) {
+			memset(q+x, q[x-1], k);		/* run of one colour */
+		}
+		else if (above && (k = samerun(p+3*x, above+3*x, width-x))) {
+			memcpy(q+x, qabove+x, k);	/* repeat of the row above */
+		}
+		else {
+			q[x] = netsearch(p[3*x], p[3*x+1], p[3*x+2]);
+			x++;
+			continue;
+		}
+		runhits += k;
+		x += k;
+	}
+	runpixels += width;
+}
+
+
+/* Map a width x height BGR image to colour indices with netsearch, reusing
+   the index of the previous pixel or the pixel above when the colour repeats
+   -------------------------------------------------------------------------- */
+
+void mapimage(const unsigned char *bgr, int width, int height, unsigned char *indices)
+{
+	register const unsigned char *p;
+	register unsigned char *q;
+	int y;
+
+	for (y=0; y<height; y++) {
+		p = bgr + 3L*y*width;
+		q = indices + (long) y*width;
+		if (y > 0) maprow(p, p-3*width, q, q-width, width);
+		else maprow(p, NULL, q, NULL, width);
+	}
+}
+
+
+/* Interleave n pixels of a row into BGR triples at q, 16 at a time where
+   the cpu allows (q needs 16 bytes of slack)
+   ---------------------------------------------------------------------- */
+
+#ifdef batchsimd
+
+static unsigned char weavemask[3][3][16];	/* pshufb masks: [output][channel] */
+static int weaveready;
+
+static void weavebuild()
+{
+	int v,c,i;
+
+	for (v=0; v<3; v++)
+		for (c=0; c<3; c++)
+			for (i=0; i<16; i++)
+				weavemask[v][c][i] = ((16*v+i)%3 == c) ? (16*v+i)/3 : 0x80;
+	weaveready = 1;
+}
+
+__attribute__((target("ssse3")))
+static void weave16(__m128i b, __m128i g, __m128i r, unsigned char *q)
+{
+	int v;
+
+	for (v=0; v<3; v++)
+		_mm_storeu_si128((__m128i *) (q+16*v), _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i *) weavemask[v][0])),
+			_mm_shuffle_epi8(g, _mm_loadu_si128((const __m128i *) weavemask[v][1]))),
+			_mm_shuffle_epi8(r, _mm_loadu_si128((const __m128i *) weavemask[v][2]))));
+}
+
+__attribute__((target("ssse3")))
+static int gatherplanes(const unsigned char *pb, const unsigned char *pg, const unsigned char *pr, int n, unsigned char *q)
+{
+	int k;
+
+	for (k=0; k+16<=n; k+=16, q+=48)
+		weave16(_mm_loadu_si128((const __m128i *) (pb+k)), _mm_loadu_si128((const __m128i *) (pg+k)),
+			_mm_loadu_si128((const __m128i *) (pr+k)), q);
+	return k;
+}
+
+__attribute__((target("ssse3")))
+static __m128i floatbytes(const float *p)
+{
+	/* clamp first, so packing saturation never sees out-of-range values */
+	__m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255);
+	__m128i a,b,c,d;
+
+	a = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), lo), hi));
+	b = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p+4), lo), hi));
+	c = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p+8), lo), hi));
+	d = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p+12), lo), hi));
+	return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+
+__attribute__((target("ssse3")))
+static int gatherfloats(const float *pb, const float *pg, const float *pr, int n, unsigned char *q)
+{
+	int k;
+
+	for (k=0; k+16<=n; k+=16, q+=48)
+		weave16(floatbytes(pb+k), floatbytes(pg+k), floatbytes(pr+k), q);
+	return k;
+}
+
+__attribute__((target("ssse3")))
+static int gatherquads(const unsigned char *p, int ob, int og, int or_, int n, unsigned char *q)
+{
+	/* p is the lowest channel of the first pixel, so 16 bytes from it */
+	/* can run past the last pixel converted: keep one pixel spare */
+	const __m128i mask = _mm_setr_epi8(ob, og, or_, 4+ob, 4+og, 4+or_,
+		8+ob, 8+og, 8+or_, 12+ob, 12+og, 12+or_, -1, -1, -1, -1);
+	int k;
+
+	for (k=0; k+5<=n; k+=4, p+=16, q+=12)
+		_mm_storeu_si128((__m128i *) q, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), mask));
+	return k;
+}
+
+__attribute__((target("ssse3")))
+static int gather565(const unsigned char *p, int n, unsigned char *q)
+{
+	const __m128i m5 = _mm_set1_epi16(31), m6 = _mm_set1_epi16(63);
+	__m128i v,w,b0,g0,r0,b1,g1,r1;
+	int k;
+
+	for (k=0; k+16<=n; k+=16, p+=32, q+=48) {
+		v = _mm_loadu_si128((const __m128i *) p);
+		w = _mm_loadu_si128((const __m128i *) (p+16));
+		b0 = _mm_and_si128(v, m5);
+		g0 = _mm_and_si128(_mm_srli_epi16(v, 5), m6);
+		r0 = _mm_srli_epi16(v, 11);
+		b1 = _mm_and_si128(w, m5);
+		g1 = _mm_and_si128(_mm_srli_epi16(w, 5), m6);
+		r1 = _mm_srli_epi16(w, 11);
+		b0 = _mm_or_si128(_mm_slli_epi16(b0, 3), _mm_srli_epi16(b0, 2));
+		g0 = _mm_or_si128(_mm_slli_epi16(g0, 2), _mm_srli_epi16(g0, 4));
+		r0 = _mm_or_si128(_mm_slli_epi16(r0, 3), _mm_srli_epi16(r0, 2));
+		b1 = _mm_or_si128(_mm_slli_epi16(b1, 3), _mm_srli_epi16(b1, 2));
+		g1 = _mm_or_si128(_mm_slli_epi16(g1, 2), _mm_srli_epi16(g1, 4));
+		r1 = _mm_or_si128(_mm_slli_epi16(r1, 3), _mm_srli_epi16(r1, 2));
+		weave16(_mm_packus_epi16(b0, b1), _mm_packus_epi16(g0, g1), _mm_packus_epi16(r0, r1), q);
+	}
+	return k;
+}
+
+#endif
+
+/* Whether gatherrow and packrow may use their SSSE3 kernels, building the
+   weave masks on first use
+   ------------------------------------------------------------------------ */
+
+static int gathersimd()
+{
+#ifdef batchsimd
+	if (!__builtin_cpu_supports("ssse3")) return 0;
+	if (!weaveready) weavebuild();
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+static void gatherrow(const unsigned char *const *chan, int stride, int packing, const float *const *pf,
+	long pix, int n, int simd, unsigned char *q)
+{
+	register const unsigned char *pb,*pg,*pr;
+#ifdef batchsimd
+	const unsigned char *p;
+#endif
+	int k,b,g,r;
+
+	k = 0;
+	if (pf) {
+#ifdef batchsimd
+		if (simd) k = gatherfloats(pf[0]+pix, pf[1]+pix, pf[2]+pix, n, q);
+#endif
+		for (q+=3*k; k<n; k++, q+=3) {
+			q[0] = planebyte(pf[0][pix+k]);
+			q[1] = planebyte(pf[1][pix+k]);
+			q[2] = planebyte(pf[2][pix+k]);
+		}
+		return;
+	}
+
+	pb = chan[0] + pix;
+	pg = chan[1] + pix;
+	pr = chan[2] + pix;
+	if (packing == view565) {
+#ifdef batchsimd
+		if (simd && stride == 2) k = gather565(pb, n, q);
+#endif
+		for (q+=3*k, pb+=k*stride; k<n; k++, q+=3, pb+=stride) {
+			expand565(pb[0] | (pb[1] << 8), &b, &g, &r);
+			q[0] = b;
+			q[1] = g;
+			q[2] = r;
+		}
+		return;
+	}
+#ifdef batchsimd
+	if (simd && stride == 1) k = gatherplanes(pb, pg, pr, n, q);
+	p = (pb < pg) ? pb : pg;
+	if (pr < p) p = pr;
+	if (simd && stride == 4 && pb-p < 4 && pg-p < 4 && pr-p < 4)
+		k = gatherquads(p, pb-p, pg-p, pr-p, n, q);
+#endif
+	for (q+=3*k, pb+=k*stride, pg+=k*stride, pr+=k*stride; k<n; k++, q+=3, pb+=stride, pg+=stride, pr+=stride) {
+		q[0] = *pb;
+		q[1] = *pg;
+		q[2] = *pr;
+	}
+}
+
+
+/* Pack n indices into bits bits each, first pixel in the high bits of
+   each byte (as PNG and BMP), padding the last byte with zeros
+   -------------------------------------------------------------------- */
+
+#ifdef batchsimd
+
+__attribute__((target("ssse3")))
+static int packindices(const unsigned char *p, int n, int bits, unsigned char *q)
+{
+	const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	const __m128i mask = _mm_set1_epi8((1 << bits) - 1);
+	__m128i v;
+	int k,m;
+
+	for (k=0; k+16<=n; k+=16) {
+		v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (p+k)), mask);
+		if (bits == 4) {		/* 16*a + b per byte pair */
+			v = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0110));
+			_mm_storel_epi64((__m128i *) q, _mm_packus_epi16(v, v));
+			q += 8;
+		}
+		else if (bits == 2) {		/* then 16*(4a+b) + 4c+d per pair of pairs */
+			v = _mm_madd_epi16(_mm_maddubs_epi16(v, _mm_set1_epi16(0x0104)), _mm_set1_epi32(0x00010010));
+			v = _mm_packs_epi32(v, v);
+			m = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+			memcpy(q, &m, 4);
+			q += 4;
+		}
+		else {				/* bit 0 of each byte to its top, in reverse */
+			m = _mm_movemask_epi8(_mm_slli_epi16(_mm_shuffle_epi8(v, reverse), 7));
+			q[0] = m;
+			q[1] = m >> 8;
+			q += 2;
+		}
+	}
+	return k;
+}
+
+#endif
+
+static void packrow(const unsigned char *p, int n, int bits, int simd, unsigned char *q)
+{
+	register int k,j,byte,mask;
+
+	k = 0;
+#ifdef batchsimd
+	if (simd) {
+		k = packindices(p, n, bits, q);
+		q += k*bits/8;
+	}
+#endif
+	mask = (1 << bits) - 1;
+	for (; k<n; k+=8/bits) {
+		byte = 0;
+		for (j=k; j<k+8/bits; j++) byte = (byte << bits) | ((j < n) ? p[j] & mask : 0);
+		*q++ = byte;
+	}
+}
+
+
+/* Map a width x height picture with channels at chan[c] + x*stride + y*pitch
+   (or float planes pf), interleaving strips of rows in a small buffer for
+   mapimage or, if batched, batchsearch, and writing rows indexpitch apart
+   with bits (1, 2, 4 or 8) per index
+   --------------------------------------------------------------------------- */
+
+static void mapsource(const unsigned char *const *chan, int stride, int pitch, int packing, const float *const *pf,
+	int width, int height, unsigned char *indices, int indexpitch, int bits, int batched)
+{
+	unsigned char strip[3*planarchunk+16],stripidx[planarchunk];
+	unsigned char *out;
+	int rows,cols,c,x,y,i,n,simd;
+
+	simd = gathersimd();
+
+	/* packed BGR needs no strips */
+	if (bits == 8 && chan && packing == viewbytes && chan[1] == chan[0]+1 && chan[2] == chan[0]+2 && stride == 3
+	    && pitch == 3*width && indexpitch == width) {
+		if (batched) batchsearch(chan[0], (long) width*height, indices);
+		else mapimage(chan[0], width, height, indices);
+		return;
+	}
+
+	/* strips are whole rows where a row fits, so runs down rows still hit */
+	rows = planarchunk/width;
+	cols = rows ? width : planarchunk;
+	if (rows < 1) rows = 1;
+	for (y=0; y<height; y+=rows) {
+		if (rows > height-y) rows = height-y;
+		for (x=0; x<width; x+=cols) {
+			c = (cols < width-x) ? cols : width-x;
+			n = rows*c;
+			for (i=0; i<rows; i++)
+				gatherrow(chan, stride, packing, pf,
+					chan ? (long) (y+i)*pitch + (long) x*stride : (long) (y+i)*width + x,
+					c, simd, strip + 3*i*c);
+			out = indices + (long) y*indexpitch + x;
+			if (bits < 8 || (rows > 1 && indexpitch != c)) out = stripidx;
+			if (batched) batchsearch(strip, n, out);
+			else mapimage(strip, c, rows, out);
+			if (out != stripidx) continue;
+			/* x is a multiple of planarchunk, so packed rows split on bytes */
+			for (i=0; i<rows; i++)
+				if (bits < 8) packrow(stripidx + i*c, c, bits, simd, indices + (long) (y+i)*indexpitch + x*bits/8);
+				else memcpy(indices + (long) (y+i)*indexpitch + x, stripidx + i*c, c);
+		}
+	}
+}
+
+void mapplanar(const unsigned char *b, const unsigned char *g, const unsigned char *r,
+	int width, int height, unsigned char *indices, int batched)
+{
+	const unsigned char *p[3] = {b, g, r};
+
+	mapsource(p, 1, width, viewbytes, NULL, width, height, indices, width, 8, batched);
+}
+
+void mapplanarf(const float *b, const float *g, const float *r,
+	int width, int height, unsigned char *indices, int batched)
+{
+	const float *p[3] = {b, g, r};
+
+	mapsource(NULL, 0, 0, viewbytes, p, width, height, indices, width, 8, batched);
+}
+
+
+/* Map a padded or multi-byte-pixel image to indices in a pitched buffer
+   --------------------------------------------------------------------- */
+
+void mapview(const imageview *view, unsigned char *indices, int indexpitch, int batched)
+{
+	const unsigned char *p[3];
+
+	p[0] = view->base + view->boffset;
+	p[1] = view->base + view->goffset;
+	p[2] = view->base + view->roffset;
+	mapsource(p, view->stride, view->pitch, view->packing, NULL, view->width, view->height, indices, indexpitch, 8, batched);
+}
+
+
+/* Map an image view to indices packed 1, 2 or 4 to a byte in a pitched buffer
+   --------------------------------------------------------------------------- */
+
+void mappacked(const imageview *view, unsigned char *packed, int packedpitch, int bits, int batched)
+{
+	const unsigned char *p[3];
+
+	if (bits != 1 && bits != 2 && bits != 4) bits = 8;
+	p[0] = view->base + view->boffset;
+	p[1] = view->base + view->goffset;
+	p[2] = view->base + view->roffset;
+	mapsource(p, view->stride, view->pitch, view->packing, NULL, view->width, view->height, packed, packedpitch, bits, batched);
+}
+
+
+/* Lay out each BGR colour of a colour map as a pixel in format, with any
+   alpha opaque; returns bytes per pixel
+   ----------------------------------------------------------------------- */
+
+static int palettepixels(const unsigned char *map, int format, unsigned char pix[netsize][8])
+{
+	imageview view;
+	int i,v;
+
+	view = makeview(NULL, 1, 1, 0, format);
+	for (i=0; i<netcolours; i++) {
+		memset(pix[i], 255, 8);
+		if (view.packing == view565) {
+			v = ((map[3*i+2] >> 3) << 11) | ((map[3*i+1] >> 2) << 5) | (map[3*i] >> 3);
+			pix[i][0] = v;
+			pix[i][1] = v >> 8;
+			continue;
+		}
+		pix[i][view.boffset] = map[3*i];
+		pix[i][view.goffset] = map[3*i+1];
+		pix[i][view.roffset] = map[3*i+2];
+		if (format == pixrgb48) {		/* v*257 widens v exactly */
+			pix[i][view.boffset-1] = map[3*i];
+			pix[i][view.goffset-1] = map[3*i+1];
+			pix[i][view.roffset-1] = map[3*i+2];
+		}
+	}
+	return view.stride;
+}
+
+
+/* Copy the colour map by colour number as pixels in a pixfmt format
+   ----------------------------------------------------------------- */
+
+void getpalette(unsigned char *palette, int format)
+{
+	unsigned char map[3*netsize],pix[netsize][8];
+	int i,size;
+
+	getcolourmap(map);
+	size = palettepixels(map, format, pix);
+	for (i=0; i<netcolours; i++) memcpy(palette + i*size, pix[i], size);
+}
+
+
+/* Map an image view to an index plane and give the palette it indexes
+   ------------------------------------------------------------------- */
+
+void mapindexed(const imageview *view, unsigned char *indices, int indexpitch,
+	unsigned char *palette, int format, int batched)
+{
+	getpalette(palette, format);
+	mapview(view, indices, indexpitch, batched);
+}
+
+
+/* Rebuild a picture in a pixfmt format from an index plane and its palette
+   ------------------------------------------------------------------------ */
+
+void reconstruct(const unsigned char *indices, int indexpitch, int width, int height,
+	const unsigned char *palette, unsigned char *out, int pitch, int format)
+{
+	unsigned char pix[netsize][8];
+	register const unsigned char *p;
+	register unsigned char *q;
+	int x,y,size;
+
+	size = palettepixels(palette, format, pix);
+	if (pitch == 0) pitch = width*size;
+	for (y=0; y<height; y++) {
+		p = indices + (long) y*indexpitch;
+		q = out + (long) y*pitch;
+		/* fixed sizes let each copy become a single move */
+		switch (size) {
+		case 2: for (x=0; x<width; x++, q+=2) memcpy(q, pix[p[x]], 2); break;
+		case 3: for (x=0; x<width; x++, q+=3) memcpy(q, pix[p[x]], 3); break;
+		case 4: for (x=0; x<width; x++, q+=4) memcpy(q, pix[p[x]], 4); break;
+		default: for (x=0; x<width; x++, q+=size) memcpy(q, pix[p[x]], size); break;
+		}
+	}
+}
+
+void reconstructplanarf(const unsigned char *indices, long n, const unsigned char *palette,
+	float *b, float *g, float *r)
+{
+	float fb[netsize],fg[netsize],fr[netsize];
+	long i;
+
+	for (i=0; i<netcolours; i++) {
+		fb[i] = palette[3*i];
+		fg[i] = palette[3*i+1];
+		fr[i] = palette[3*i+2];
+	}
+	for (i=0; i<n; i++) {
+		b[i] = fb[indices[i]];
+		g[i] = fg[indices[i]];
+		r[i] = fr[indices[i]];
+	}
+}
+
+
+/* Return mapimage counts since inxbuild
+   ------------------------------------- */
+
+void getrunstats(long *pixels, long *hits)
+{
+	*pixels = runpixels;
+	*hits = runhits;
+}
+
+
+/* Return search counts since inxbuild
+   ----------------------------------- */
+
+void getsearchstats(long *queries, long *visits)
+{
+	*queries = searchqueries;
+	*visits = searchvisits;
+}
+
+
+/* Search for biased BGR values
+   ---------------------------- */
+
+int contest(register int b, register int g, register int r)
+{
+	/* finds closest neuron (min dist) and updates freq */
+	/* finds best neuron (min dist-bias) and returns position */
+	/* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
+	/* bias[i] = gamma*((1/netsize)-freq[i]) */
+
+	register int i,dist,a,biasdist,betafreq;
+	int bestpos,bestbiaspos,bestd,bestbiasd;
+	register int *p,*f, *n;
+
+	bestd = ~(((int) 1)<<31);
+	bestbiasd = bestd;
+	bestpos = -1;
+	bestbiaspos = bestpos;
+	p = bias;
+	f = freq;
+
+	for (i=0; i<netcolours; i++) {
+		n = network[i];
+		dist = n[0] - b;   if (dist<0) dist = -dist;
+		a = n[1] - g;   if (a<0) a = -a;
+		dist += a;
+		a = n[2] - r;   if (a<0) a = -a;
+		dist += a;
+		if (dist<bestd) {bestd=dist; bestpos=i;}
+		biasdist = dist - ((*p)>>(intbiasshift-netbiasshift));
+		if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
+		betafreq = (*f >> betashift);
+		*f++ -= betafreq;
+		*p++ += (betafreq<<gammashift);
+	}
+	freq[bestpos] += beta;
+	bias[bestpos] -= betagamma;
+	return(bestbiaspos);
+}
+
+
+/* Search for biased BGR values by squared distance (scalar reference)
+   ------------------------------------------------------------------- */
+
+static int contestl2(register int b, register int g, register int r)
+{
+	/* as contest, with the bias term scaled to squared distances */
+
+	register int i,dist,a,biasdist,betafreq;
+	int bestpos,bestbiaspos,bestd,bestbiasd;
+	register int *p,*f, *n;
+
+	bestd = ~(((int) 1)<<31);
+	bestbiasd = bestd;
+	bestpos = -1;
+	bestbiaspos = bestpos;
+	p = bias;
+	f = freq;
+
+	for (i=0; i<netcolours; i++) {
+		n = network[i];
+		a = n[0] - b;   dist = a*a;
+		a = n[1] - g;   dist += a*a;
+		a = n[2] - r;   dist += a*a;
+		if (dist<bestd) {bestd=dist; bestpos=i;}
+		biasdist = dist - ((*p)>>l2biasshift);
+		if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
+		betafreq = (*f >> betashift);
+		*f++ -= betafreq;
+		*p++ += (betafreq<<gammashift);
+	}
+	freq[bestpos] += beta;
+	bias[bestpos] -= betagamma;
+	return(bestbiaspos);
+}
+
+
+#ifdef batchsimd
+
+/* Search for biased BGR values by squared distance, 8 neurons at a time
+   --------------------------------------------------------------------- */
+
+__attribute__((target("avx2")))
+static int contestl2avx2(int b, int g, int r)
+{
+	/* differences fit 16 bits, so pack pairs of neurons and square and */
+	/* add them with pmaddwd; ties go to the lowest index, as in contestl2 */
+
+	const __m256i q = _mm256_setr_epi32(b, g, r, 0, b, g, r, 0);
+	const __m256i mask = _mm256_setr_epi32(-1, -1, -1, 0, -1, -1, -1, 0);
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i x0,x1,x2,x3,dist,biasdist,bv,fv,bf,lt;
+	__m256i pos,bestd,bestpos,bestbiasd,bestbiaspos;
+	int d[8],bd[8],bp[8],bbp[8];
+	int i,bestpos1,bestbiaspos1;
+
+	pos = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	bestd = bestbiasd = _mm256_set1_epi32(~(((int) 1)<<31));
+	bestpos = bestbiaspos = _mm256_setzero_si256();
+	for (i=0; i<netcolours; i+=8) {
+		x0 = _mm256_and_si256(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) network[i]), q), mask);
+		x1 = _mm256_and_si256(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) network[i+2]), q), mask);
+		x2 = _mm256_and_si256(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) network[i+4]), q), mask);
+		x3 = _mm256_and_si256(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) network[i+6]), q), mask);
+		x0 = _mm256_packs_epi32(x0, x1);	/* neurons 0 2 | 1 3 */
+		x2 = _mm256_packs_epi32(x2, x3);	/* neurons 4 6 | 5 7 */
+		dist = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(
+			_mm256_madd_epi16(x0, x0), _mm256_madd_epi16(x2, x2)), order);
+
+		lt = _mm256_cmpgt_epi32(bestd, dist);
+		bestd = _mm256_min_epi32(bestd, dist);
+		bestpos = _mm256_blendv_epi8(bestpos, pos, lt);
+
+		bv = _mm256_loadu_si256((const __m256i *) (bias+i));
+		fv = _mm256_loadu_si256((const __m256i *) (freq+i));
+		biasdist = _mm256_sub_epi32(dist, _mm256_srai_epi32(bv, l2biasshift));
+		lt = _mm256_cmpgt_epi32(bestbiasd, biasdist);
+		bestbiasd = _mm256_min_epi32(bestbiasd, biasdist);
+		bestbiaspos = _mm256_blendv_epi8(bestbiaspos, pos, lt);
+
+		bf = _mm256_srai_epi32(fv, betashift);
+		_mm256_storeu_si256((__m256i *) (freq+i), _mm256_sub_epi32(fv, bf));
+		_mm256_storeu_si256((__m256i *) (bias+i), _mm256_add_epi32(bv, _mm256_slli_epi32(bf, gammashift)));
+		pos = _mm256_add_epi32(pos, _mm256_set1_epi32(8));
+	}
+
+	_mm256_storeu_si256((__m256i *) d, bestd);
+	_mm256_storeu_si256((__m256i *) bp, bestpos);
+	_mm256_storeu_si256((__m256i *) bd, bestbiasd);
+	_mm256_storeu_si256((__m256i *) bbp, bestbiaspos);
+	bestpos1 = bestbiaspos1 = 0;
+	for (i=1; i<8; i++) {
+		if (d[i] < d[bestpos1] || (d[i] == d[bestpos1] && bp[i] < bp[bestpos1])) bestpos1 = i;
+		if (bd[i] < bd[bestbiaspos1] || (bd[i] == bd[bestbiaspos1] && bbp[i] < bbp[bestbiaspos1])) bestbiaspos1 = i;
+	}
+	freq[bp[bestpos1]] += beta;
+	bias[bp[bestpos1]] -= betagamma;
+	return(bbp[bestbiaspos1]);
+}
+
+#endif
+
+static int contestl2fast(int b, int g, int r)
+{
+#ifdef batchsimd
+	return(contestl2avx2(b,g,r));
+#else
+	return(contestl2(b,g,r));
+#endif
+}
+
+
+/* Search for biased BGR values, skipping neurons that the triangle inequality
+   shows cannot win (same result as contest)
+   --------------------------------------------------------------------------- */
+
+static int contesttri(register int b, register int g, register int r)
+{
+	/* for a reference neuron c at distance dc, dist(x,i) >= dist(c,i) - dc, */
+	/* and dist(c,i) >= netdist[c][i] - drift[c] - drift[i] within a cycle; */
+	/* i is skipped when that bound exceeds a distance already achieved */
+
+	register int i,dist,a,biasdist,betafreq,lb;
+	int bestpos,bestbiaspos,bestd,bestbiasd,upper,biasupper,refd,skipped;
+	register int *p,*f, *n;
+	short *row;
+
+	/* seed the reference with the neuron of nearest brightness */
+	i = seedtable[(b+g+r) >> seedshift];
+	n = network[i];
+	dist = n[0] - b;   if (dist<0) dist = -dist;
+	a = n[1] - g;   if (a<0) a = -a;
+	dist += a;
+	a = n[2] - r;   if (a<0) a = -a;
+	dist += a;
+	row = netdist[i];
+	refd = drift[i] + dist;
+	upper = dist;
+	biasupper = dist - (bias[i]>>(intbiasshift-netbiasshift));
+
+	bestd = ~(((int) 1)<<31);
+	bestbiasd = bestd;
+	bestpos = -1;
+	bestbiaspos = bestpos;
+	p = bias;
+	f = freq;
+	skipped = 0;
+
+	for (i=0; i<netcolours; i++) {
+		lb = row[i] - refd - drift[i];
+		if (lb > upper && lb - ((*p)>>(intbiasshift-netbiasshift)) > biasupper)
+			skipped++;		/* cannot win either contest */
+		else {
+			n = network[i];
+			dist = n[0] - b;   if (dist<0) dist = -dist;
+			a = n[1] - g;   if (a<0) a = -a;
+			dist += a;
+			a = n[2] - r;   if (a<0) a = -a;
+			dist += a;
+			if (dist<bestd) {bestd=dist; bestpos=i;}
+			biasdist = dist - ((*p)>>(intbiasshift-netbiasshift));
+			if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
+			if (dist<upper) {upper=dist; row=netdist[i]; refd=drift[i]+dist;}
+			if (biasdist<biasupper) biasupper=biasdist;
+		}
+		betafreq = (*f >> betashift);
+		*f++ -= betafreq;
+		*p++ += (betafreq<<gammashift);
+	}
+	freq[bestpos] += beta;
+	bias[bestpos] -= betagamma;
+	contestskips[contestcycles] += skipped;
+	return(bestbiaspos);
+}
+
+
+/* Refresh neuron distances and seeds for contesttri at a cycle boundary
+   --------------------------------------------------------------------- */
+
+static void refreshdist()
+{
+	register int i,j,dist,a;
+	register int *n,*m;
+	int best,bestd;
+
+	for (i=0; i<netcolours; i++) {
+		n = network[i];
+		netdist[i][i] = 0;
+		for (j=i+1; j<netcolours; j++) {
+			m = network[j];
+			dist = n[0] - m[0];   if (dist<0) dist = -dist;
+			a = n[1] - m[1];   if (a<0) a = -a;
+			dist += a;
+			a = n[2] - m[2];   if (a<0) a = -a;
+			dist += a;
+			netdist[i][j] = netdist[j][i] = dist;
+		}
+		drift[i] = 0;
+	}
+	for (j=0; j<seeds; j++) {
+		best = 0;
+		bestd = ~(((int) 1)<<31);
+		for (i=0; i<netcolours; i++) {
+			n = network[i];
+			dist = n[0] + n[1] + n[2] - ((j << seedshift) + (1 << (seedshift-1)));
+			if (dist<0) dist = -dist;
+			if (dist<bestd) {bestd=dist; best=i;}
+		}
+		seedtable[j] = best;
+	}
+}
+
+
+/* Move neuron i towards biased (b,g,r) by factor alpha
+   ---------------------------------------------------- */
+
+void altersingle(register int alpha, register int i, register int b, register int g, register int r)
+{
+	register int *n;
+	register int d,m;
+
+//	printf("New point %d: ", i);
+
+	n = network[i];				/* alter hit neuron */
+	d = (alpha*(*n - b)) / initalpha;   *n -= d;   m = (d<0) ? -d : d;
+//	printf("%f, ", *n / 16.0);
+	n++;
+	d = (alpha*(*n - g)) / initalpha;   *n -= d;   m += (d<0) ? -d : d;
+//  printf("%f, ", *n / 16.0);
+	n++;
+	d = (alpha*(*n - r)) / initalpha;   *n -= d;   m += (d<0) ? -d : d;
+//  printf("%f\n", *n / 16.0);
+	if (tripruning) drift[i] += m;
+	if (convthresh) movement += m;
+}
+
+
+/* Move adjacent neurons by precomputed alpha*(1-((i-j)^2/[r]^2)) in radpower[|i-j|]
+   --------------------------------------------------------------------------------- */
+
+void alterneigh(int rad, int i, register int b, register int g, register int r)
+{
+	register int j,k,lo,hi,a,d,e,m;
+	register int *p, *q;
+
+	lo = i-rad;   if (lo<-1) lo=-1;
+	hi = i+rad;   if (hi>netcolours) hi=netcolours;
+
+	j = i+1;
+	k = i-1;
+	q = radpower;
+	if (!tripruning && !convthresh) {	/* nothing watches the movement */
+		while ((j<hi) || (k>lo)) {
+			a = (*(++q));
+			if (j<hi) {
+				p = network[j];
+				*p -= (a*(*p - b)) / alpharadbias;
+				p++;
+				*p -= (a*(*p - g)) / alpharadbias;
+				p++;
+				*p -= (a*(*p - r)) / alpharadbias;
+				j++;
+			}
+			if (k>lo) {
+				p = network[k];
+				*p -= (a*(*p - b)) / alpharadbias;
+				p++;
+				*p -= (a*(*p - g)) / alpharadbias;
+				p++;
+				*p -= (a*(*p - r)) / alpharadbias;
+				k--;
+			}
+		}
+		return;
+	}
+	m = 0;
+	while ((j<hi) || (k>lo)) {
+		a = (*(++q));
+		if (j<hi) {
+//		  printf("New point %d: ", j);
+			p = network[j];
+			d = (a*(*p - b)) / alpharadbias;   *p -= d;   e = (d<0) ? -d : d;
+//		  printf("%f, ", *p / 16.0);
+			p++;
+			d = (a*(*p - g)) / alpharadbias;   *p -= d;   e += (d<0) ? -d : d;
+//		  printf("%f, ", *p / 16.0);
+			p++;
+			d = (a*(*p - r)) / alpharadbias;   *p -= d;   e += (d<0) ? -d : d;
+//		  printf("%f\n", *p / 16.0);
+			if (tripruning) drift[j] += e;
+			m += e;
+			j++;
+		}
+		if (k>lo) {
+//      printf("New point %d: ", k);
+			p = network[k];
+			d = (a*(*p - b)) / alpharadbias;   *p -= d;   e = (d<0) ? -d : d;
+//      printf("%f, ", *p / 16.0);
+			p++;
+			d = (a*(*p - g)) / alpharadbias;   *p -= d;   e += (d<0) ? -d : d;
+//      printf("%f, ", *p / 16.0);
+			p++;
+			d = (a*(*p - r)) / alpharadbias;   *p -= d;   e += (d<0) ? -d : d;
+//      printf("%f\n", *p / 16.0);
+			if (tripruning) drift[k] += e;
+			m += e;
+			k--;
+		}
+	}
+	if (convthresh) movement += m;
+}
+
+
+/* Pass an unbiased copy of the network to the snapshot callback
+   ------------------------------------------------------------- */
+
+static void takesnapshot(int cycle)
+{
+	unsigned char map[3*netsize];
+	int i,j,temp;
+
+	for (i=0; i<netcolours; i++) {
+		for (j=0; j<3; j++) {
+			temp = (network[i][j] + (1 << (netbiasshift - 1))) >> netbiasshift;
+			if (temp > 255) temp = 255;
+			if (temp < 0) temp = 0;
+			map[3*i+j] = temp;
+		}
+	}
+	(*snapfunc)(map, cycle, snapdata);
+}
+
+
+/* Pick a prime step for a picture of len bytes
+   --------------------------------------------- */
+
+static int learnstep(long len)
+{
+	if ((len%prime1) != 0) return 3*prime1;
+	if ((len%prime2) != 0) return 3*prime2;
+	if ((len%prime3) != 0) return 3*prime3;
+	return 3*prime4;
+}
+
+
+/* Box-filter blocks of about multiresfac pixels (square where the picture
+   has rows enough) into a coarse picture for the early cycles, which draw
+   want samples: only want/multiresfac blocks, spread evenly over the
+   picture, so building reads no more pixels than sampling would
+   ------------------------------------------------------------------------ */
+
+static unsigned char *buildcoarse(long want, long *len)
+{
+	register int b,g,r;
+	register unsigned char *q;
+	unsigned char *coarse;
+	long i,n,x,y,x0,y0,rows,across,blocks;
+	int bw,bh,area,pb,pg,pr;
+
+	rows = lengthcount/(3*picwidth);
+	for (bh=1; (bh+1)*(bh+1) <= multiresfac; bh++);
+	if (rows < bh) bh = 1;			/* a single row: runs along it */
+	bw = multiresfac / bh;
+	area = bw*bh;
+	across = picwidth / bw;
+	blocks = across*(rows / bh);
+	n = want / area;
+	if (n > blocks) n = blocks;
+	if (3*n < minpicturebytes) return NULL;
+	coarse = (unsigned char *) malloc(3*n);
+	if (coarse == NULL) return NULL;
+
+	q = coarse;
+	for (i=0; i<n; i++) {
+		y0 = (long) ((double) i*blocks/n);	/* block number, in row order */
+		x0 = (y0 % across)*bw;
+		y0 = (y0 / across)*bh;
+		b = g = r = area >> 1;			/* round to nearest */
+		for (y=y0; y<y0+bh; y++)
+			for (x=x0; x<x0+bw; x++) {
+				picturepixelxy(x, y, &pb, &pg, &pr);
+				b += pb;
+				g += pg;
+				r += pr;
+			}
+		q[0] = b / area;
+		q[1] = g / area;
+		q[2] = r / area;
+		q += 3;
+	}
+	*len = 3*n;
+	return coarse;
+}
+
+
+/* Main Learning Loop
+   ------------------ */
+
+void learn()
+{
+	register int j;
+	int b,g,r;
+	int radius,rad,alpha,quiet,l2simd;
+	register unsigned char *p;
+	unsigned char *coarse;
+	long i,step,delta,samplepixels,pix,lim,coarsecount,want;
+
+	/* sample by pixel number, so planar pictures need no interleaved copy */
+	alphadec = 30 + ((samplefac-1)/3);
+	pix = 0;
+	lim = lengthcount/3;
+	samplepixels = learnpixels ? learnpixels : lengthcount/(3*samplefac);
+	delta = samplepixels/ncycles;
+	alpha = initalpha;
+	radius = (netcolours >> 3) << radiusbiasshift;	/* initradius for 256 colours */
+	if (warmcycles) {
+		/* a warm network is already ordered: run only the schedule tail */
+		for (i=warmcycles; i<ncycles; i++) {
+			alpha -= alpha / alphadec;
+			radius -= radius / radiusdec;
+		}
+		samplepixels = delta*warmcycles;
+	}
+	
+	rad = radius >> radiusbiasshift;
+	if (rad <= 1) rad = 0;
+	for (i=0; i<rad; i++) 
+		radpower[i] = alpha*(((rad*rad - i*i)*radbias)/(rad*rad));
+	
+//	fprintf(stderr,"beginning 1D learning: initial radius=%d\n", rad);
+
+	step = learnstep(lengthcount)/3;
+	l2simd = 0;
+#ifdef batchsimd
+	l2simd = (netcolours % 8 == 0) && __builtin_cpu_supports("avx2");
+#endif
+	movement = 0;
+	quiet = 0;
+	cyclesskipped = 0;
+	contestcycles = 0;
+	contestdelta = delta;
+	memset(contestskips, 0, sizeof(contestskips));
+	memset(drift, 0, sizeof(drift));	/* only tracked while pruning */
+	if (tripruning) refreshdist();
+
+	/* high-radius cycles only shape global structure, so train them on a */
+	/* small box-filtered copy that stays in cache, as big as they sample */
+	coarse = NULL;
+	if (multiresfac && rad >= multiresrad) {
+		want = 0;
+		for (j=radius; (j >> radiusbiasshift) >= multiresrad && want < samplepixels; j -= j/radiusdec)
+			want += delta;
+		coarse = buildcoarse(want, &coarsecount);
+	}
+	if (coarse) {
+		lim = coarsecount/3;
+		step = learnstep(coarsecount)/3;
+	}
+	
+	i = 0;
+	while (i < samplepixels) {
+		if (coarse) {
+			p = coarse + 3*pix;
+			b = p[0];
+			g = p[1];
+			r = p[2];
+		}
+		else picturepixel(pix, &b, &g, &r);
+		b <<= netbiasshift;
+		g <<= netbiasshift;
+		r <<= netbiasshift;
+		if (metric == metricl2) j = l2simd ? contestl2fast(b,g,r) : contestl2(b,g,r);
+		else j = tripruning ? contesttri(b,g,r) : contest(b,g,r);
+
+		altersingle(alpha,j,b,g,r);
+		if (rad) alterneigh(rad,j,b,g,r);   /* alter neighbours */
+
+		pix += step;
+		if (pix >= lim) pix -= lim;
+	
+		i++;
+		if (i%delta == 0) {	
+			alpha -= alpha / alphadec;
+			radius -= radius / radiusdec;
+			if (convthresh && quiet >= 0) {
+				if (movement/delta < convthresh) quiet++;
+				else quiet = 0;
+				movement = 0;
+			}
+			/* once the net has stopped moving, or the cycle limit is near, */
+			/* fast-forward the schedule to the final low-radius refinement */
+			if ((convthresh && quiet >= convcycles) ||
+			    (learncycles < ncycles && i/delta == learncycles - convfinal)) {
+				while (i < samplepixels - convfinal*delta) {
+					alpha -= alpha / alphadec;
+					radius -= radius / radiusdec;
+					i += delta;
+					cyclesskipped++;
+				}
+				quiet = -1;		/* monitor done */
+			}
+			rad = radius >> radiusbiasshift;
+			if (rad <= 1) rad = 0;
+			for (j=0; j<rad; j++) 
+				radpower[j] = alpha*(((rad*rad - j*j)*radbias)/(rad*rad));
+			if (snapfunc && (i/delta)%snapevery == 0) takesnapshot(i/delta);
+			if (tripruning) {
+				refreshdist();
+				if (contestcycles < ncycles) contestcycles++;
+			}
+			if (coarse && rad < multiresrad) {	/* switch to full resolution */
+				pix = (long) ((double) pix/lim*(lengthcount/3));
+				lim = lengthcount/3;
+				step = learnstep(lengthcount)/3;
+				free(coarse);
+				coarse = NULL;
+			}
+		}
+	}
+	if (coarse) free(coarse);
+//	fprintf(stderr,"finished 1D learning: final alpha=%f !\n",((float)alpha)/initalpha);
+}
+
+
+/* Read a monotonic wall clock in seconds
+   -------------------------------------- */
+
+static double wallclock()
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec * 0.000000001;
+}
+
+
+/* Map with a lazily filled lut of 5 bits per colour (cheap, not exact)
+   -------------------------------------------------------------------- */
+
+static short coarselut[lutsize];
+
+static void clearcoarselut()
+{
+	memset(coarselut, 0xff, sizeof(coarselut));	/* all -1 */
+}
+
+static int coarsesearch(int b, int g, int r)
+{
+	register int k;
+
+	k = ((b >> lutshift) << 10) | ((g >> lutshift) << 5) | (r >> lutshift);
+	if (coarselut[k] < 0)			/* search from the cell centre */
+		coarselut[k] = netsearch(((b >> lutshift) << lutshift) | (1 << (lutshift-1)),
+			((g >> lutshift) << lutshift) | (1 << (lutshift-1)),
+			((r >> lutshift) << lutshift) | (1 << (lutshift-1)));
+	return coarselut[k];
+}
+
+
+/* Calibrate the cost model for quantizebudget (clobbers the network)
+   ------------------------------------------------------------------ */
+
+static double costsample;			/* seconds per learning sample */
+static double costsearch;			/* seconds per netsearch */
+static double costlookup;			/* seconds per coarse lut hit */
+
+void calibrate()
+{
+	unsigned char *pic;
+	unsigned int seed;
+	int i,savedfac,savedthresh,savedcycles,savedmode,savedpruning;
+	snapshotfunc savedsnap;
+	volatile int sink;
+	double t;
+
+	pic = (unsigned char *) malloc(3*calpixels);
+	if (pic == NULL) return;
+	seed = 1;				/* noise is the worst case for inxsearch */
+	for (i=0; i<3*calpixels; i++) {
+		seed = seed*1103515245 + 12345;
+		pic[i] = seed >> 24;
+	}
+
+	/* time plain learning and inxsearch: no lut to build, no callbacks */
+	savedfac = multiresfac;
+	savedthresh = convthresh;
+	savedcycles = learncycles;
+	savedmode = searchmode;
+	savedpruning = tripruning;
+	savedsnap = snapfunc;
+	multiresfac = convthresh = 0;
+	learncycles = ncycles;
+	searchmode = searchgreen;
+	tripruning = 0;
+	snapfunc = NULL;
+
+	t = wallclock();
+	initnet(pic, 3*calpixels, 1);
+	learn();
+	costsample = (wallclock() - t) / calpixels;
+
+	unbiasnet();
+	inxbuild();
+	sink = 0;
+	t = wallclock();
+	for (i=0; i<3*calpixels; i+=3) sink += netsearch(pic[i], pic[i+1], pic[i+2]);
+	costsearch = (wallclock() - t) / calpixels;
+
+	clearcoarselut();
+	for (i=0; i<3*calpixels; i+=3) sink += coarsesearch(pic[i], pic[i+1], pic[i+2]);
+	t = wallclock();
+	for (i=0; i<3*calpixels; i+=3) sink += coarsesearch(pic[i], pic[i+1], pic[i+2]);
+	costlookup = (wallclock() - t) / calpixels;
+
+	multiresfac = savedfac;
+	convthresh = savedthresh;
+	learncycles = savedcycles;
+	searchmode = savedmode;
+	tripruning = savedpruning;
+	snapfunc = savedsnap;
+	free(pic);
+}
+
+
+/* Quantize thepic into indices (one byte per pixel) within budget seconds
+   ----------------------------------------------------------------------- */
+
+void quantizebudget(unsigned char *thepic, long len, double budget, unsigned char *indices, budgetplan *plan)
+{
+	int sample,cycles,mapping,savedcycles,savedmode;
+	long i,pixels;
+	double start,left,learnbudget,mapcost,lutcost,remaining;
+	register unsigned char *p;
+
+	start = wallclock();
+	if (costsample <= 0) calibrate();
+	left = budget - (wallclock() - start);	/* calibrating spends budget too */
+	pixels = len/3;
+
+	/* cheapest mapping first decides how much budget is left for learning */
+	mapcost = pixels*costsearch;
+	lutcost = ((pixels < lutsize) ? pixels : lutsize)*costsearch + pixels*costlookup;
+	mapping = mapexact;
+	learnbudget = left*budgetslack - mapcost;
+	if (learnbudget < (double) pixels/30*mincycles/ncycles*costsample && lutcost < mapcost) {
+		mapping = mapcoarse;
+		learnbudget = left*budgetslack - lutcost;
+	}
+
+	/* then the smallest samplefac, and failing that fewer cycles */
+	cycles = ncycles;
+	for (sample=1; sample<30; sample++)
+		if ((double) pixels/sample*costsample <= learnbudget) break;
+	if ((double) pixels/sample*costsample > learnbudget)
+		cycles = (learnbudget > 0) ? (int) (learnbudget/((double) pixels/sample*costsample)*ncycles) : mincycles;
+	if (cycles < mincycles) cycles = mincycles;
+	while (sample > 1 && pixels/sample < ncycles) sample--;	/* a sample per cycle */
+
+	savedcycles = learncycles;
+	initnet(thepic, len, sample);
+	setcycles(cycles);
+	learn();
+	learncycles = savedcycles;
+	unbiasnet();
+	savedmode = searchmode;
+	if (searchmode == searchlut) searchmode = searchgreen;	/* building 2^24 entries overruns any budget */
+	inxbuild();
+
+	/* fall back to the lut as soon as exact mapping would overrun */
+	clearcoarselut();
+	p = thepic;
+	plan->fellback = 0;
+	for (i=0; i<pixels; i++, p+=3) {
+		if (mapping == mapexact && i%budgetcheck == 0) {
+			remaining = budget - (wallclock() - start);
+			if ((pixels-i)*costsearch > remaining) {
+				mapping = mapcoarse;
+				plan->fellback = 1;
+			}
+		}
+		indices[i] = (mapping == mapexact) ? netsearch(p[0], p[1], p[2]) : coarsesearch(p[0], p[1], p[2]);
+	}
+	searchmode = savedmode;
+
+	plan->samplefac = sample;
+	plan->cycles = ncycles - learnskipped();
+	plan->mapping = mapping;
+	plan->seconds = wallclock() - start;
+}
+
+
+/* Streaming: pass one reads rows once, keeping a bounded reservoir sample to
+   train on and optionally spilling the rows run-length coded to a temporary
+   file; pass two maps rows one at a time, re-read or replayed from the spill
+   -------------------------------------------------------------------------- */
+
+static int streamwidth;				/* pixels per row */
+static int streamheight;			/* rows read by pass one */
+static int streamy;				/* rows mapped by pass two */
+static long streamseen;				/* pixels read by pass one */
+static long streamnext;				/* next pixel to enter the reservoir */
+static double streamw;				/* reservoir skip weight */
+static unsigned long long streamrand;		/* xorshift state */
+static unsigned char *streamsample;		/* reservoir of BGR triples */
+static unsigned char *streamline[2];		/* BGR of this row and the one above */
+static unsigned char *streamidx[2];		/* and their colour indices */
+static unsigned char *streamcode;		/* coded row, or literal pixels */
+static unsigned char *streamtokens;		/* tokens of a replayed row */
+static unsigned char *streamlitidx;		/* indices of its literal pixels */
+static FILE *streamspill;			/* spilled rows, NULL = none */
+static long streamspillbytes;
+
+
+/* Draw uniformly from (0,1)
+   ------------------------- */
+
+static double streamuniform()
+{
+	streamrand ^= streamrand << 13;
+	streamrand ^= streamrand >> 7;
+	streamrand ^= streamrand << 17;
+	return ((double) (streamrand >> 11) + 0.5) / 9007199254740992.0;
+}
+
+
+/* Pick the next pixel to enter the full reservoir, skipping ahead by a
+   geometric gap so most pixels cost nothing (Li's algorithm L)
+   -------------------------------------------------------------------- */
+
+static void streamskip()
+{
+	double gap;
+
+	gap = floor(log(streamuniform()) / log1p(-streamw));
+	streamnext += (gap < 1e15) ? (long) gap + 1 : 1000000000000000L;
+	streamw *= exp(log(streamuniform()) / streamreserve);
+}
+
+
+/* Offer n BGR pixels to the reservoir
+   ----------------------------------- */
+
+static void streamkeep(const unsigned char *p, int n)
+{
+	long s;
+	int k,slot;
+
+	s = streamseen;
+	if (s < streamreserve) {		/* filling: keep every pixel in order */
+		k = streamreserve - s;
+		if (k > n) k = n;
+		memcpy(streamsample + 3*s, p, 3*k);
+		if (s + k == streamreserve) {
+			streamnext = streamreserve - 1;
+			streamw = exp(log(streamuniform()) / streamreserve);
+			streamskip();
+		}
+	}
+	while (streamnext < s + n) {
+		slot = (int) (streamuniform() * streamreserve);
+		memcpy(streamsample + 3*slot, p + 3*(streamnext - s), 3);
+		streamskip();
+	}
+	streamseen += n;
+}
+
+
+/* Append a row to the spill as tokens repeating the pixel to the left,
+   copying the row above (NULL for none) or giving literal pixels
+   -------------------------------------------------------------------- */
+
+static int spillrow(const unsigned char *p, const unsigned char *a)
+{
+	register unsigned char *q;
+	int x,k,kind,w;
+
+	w = streamwidth;
+	q = streamcode;
+	for (x=0; x<w; ) {
+		if (x > 0 && (k = samerun(p+3*x, p+3*x-3, w-x))) kind = spillleft;
+		else if (a && (k = samerun(p+3*x, a+3*x, w-x))) kind = spillabove;
+		else {
+			/* literal up to the next pixel that starts a run */
+			for (k=1; x+k<w && k<spillrun; k++)
+				if (memcmp(p+3*(x+k), p+3*(x+k)-3, 3) == 0 || (a && memcmp(p+3*(x+k), a+3*(x+k), 3) == 0))
+					break;
+			*q++ = spillliteral | (k-1);
+			memcpy(q, p+3*x, 3*k);
+			q += 3*k;
+			x += k;
+			continue;
+		}
+		x += k;
+		for (; k>spillrun; k-=spillrun) *q++ = kind | (spillrun-1);
+		*q++ = kind | (k-1);
+	}
+	k = q - streamcode;
+	streamspillbytes += k;
+	return (fwrite(streamcode, 1, k, streamspill) == (size_t) k) ? 0 : -1;
+}
+
+
+/* Read a row back from the spill into p given the row above (NULL for
+   none), keeping its tokens; returns the number of tokens, or -1
+   -------------------------------------------------------------------- */
+
+static int spillread(unsigned char *p, const unsigned char *a, unsigned char *tokens)
+{
+	int x,i,k,c,t;
+
+	t = 0;
+	for (x=0; x<streamwidth; x+=k) {
+		if ((c = getc(streamspill)) == EOF) return -1;
+		k = (c & (spillrun-1)) + 1;
+		if (x + k > streamwidth) return -1;
+		switch (c & ~(spillrun-1)) {
+		case spillliteral:
+			if (fread(p+3*x, 1, 3*k, streamspill) != (size_t) (3*k)) return -1;
+			break;
+		case spillleft:
+			if (x == 0) return -1;
+			for (i=3*x; i<3*(x+k); i++) p[i] = p[i-3];
+			break;
+		case spillabove:
+			if (a == NULL) return -1;
+			memcpy(p+3*x, a+3*x, 3*k);
+			break;
+		default:
+			return -1;
+		}
+		tokens[t++] = c;
+	}
+	return t;
+}
+
+
+/* Map a replayed row by its tokens: runs copy indices as mapimage would,
+   and only literal pixels are searched (with batchsearch if batched)
+   ---------------------------------------------------------------------- */
+
+static void spillmap(const unsigned char *p, const unsigned char *tokens, int t,
+	unsigned char *q, const unsigned char *qabove, int batched)
+{
+	int x,i,k,c,n;
+
+	if (batched) {
+		n = 0;
+		for (i=0, x=0; i<t; i++, x+=k) {
+			k = (tokens[i] & (spillrun-1)) + 1;
+			if ((tokens[i] & ~(spillrun-1)) != spillliteral) continue;
+			memcpy(streamcode + 3*n, p+3*x, 3*k);
+			n += k;
+		}
+		batchsearch(streamcode, n, streamlitidx);
+	}
+	n = 0;
+	for (i=0, x=0; i<t; i++, x+=k) {
+		c = tokens[i];
+		k = (c & (spillrun-1)) + 1;
+		if ((c & ~(spillrun-1)) == spillliteral) {
+			if (batched) memcpy(q+x, streamlitidx+n, k);
+			else for (c=x; c<x+k; c++) q[c] = netsearch(p[3*c], p[3*c+1], p[3*c+2]);
+			n += k;
+			continue;
+		}
+		if ((c & ~(spillrun-1)) == spillleft) memset(q+x, q[x-1], k);
+		else memcpy(q+x, qabove+x, k);
+		runhits += k;
+	}
+	runpixels += streamwidth;
+}
+
+
+/* Release the buffers and spill of a stream
+   ----------------------------------------- */
+
+void streamend()
+{
+	free(streamsample);
+	free(streamline[0]);
+	free(streamline[1]);
+	free(streamidx[0]);
+	free(streamidx[1]);
+	free(streamcode);
+	free(streamtokens);
+	free(streamlitidx);
+	streamsample = NULL;
+	streamline[0] = streamline[1] = streamidx[0] = streamidx[1] = NULL;
+	streamcode = streamtokens = streamlitidx = NULL;
+	if (streamspill) fclose(streamspill);
+	streamspill = NULL;
+}
+
+
+/* Start pass one over a picture of rows width pixels wide
+   ------------------------------------------------------- */
+
+int streambegin(int width, int sample, int spill)
+{
+	streamend();
+	streamwidth = width;
+	streamheight = streamy = 0;
+	streamseen = streamspillbytes = 0;
+	streamnext = streamreserve;
+	streamrand = 0x9e3779b97f4a7c15ULL;	/* same sample every run */
+	samplefac = sample;
+
+	streamsample = (unsigned char *) malloc(3*streamreserve);
+	streamline[0] = (unsigned char *) malloc(3*width+16);
+	streamline[1] = (unsigned char *) malloc(3*width+16);
+	streamidx[0] = (unsigned char *) malloc(width);
+	streamidx[1] = (unsigned char *) malloc(width);
+	streamcode = (unsigned char *) malloc(4*width+16);
+	streamtokens = (unsigned char *) malloc(width);
+	streamlitidx = (unsigned char *) malloc(width);
+	if (spill) streamspill = tmpfile();
+	if (width < 1 || !streamsample || !streamline[0] || !streamline[1] || !streamidx[0] || !streamidx[1]
+	    || !streamcode || !streamtokens || !streamlitidx || (spill && !streamspill)) {
+		streamend();
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Read the next rows of the picture in pass one
+   --------------------------------------------- */
+
+int streamrows(const imageview *rows)
+{
+	const unsigned char *chan[3];
+	unsigned char *p,*a;
+	int y,simd;
+
+	if (streamsample == NULL || rows->width != streamwidth) return -1;
+	simd = gathersimd();
+	chan[0] = rows->base + rows->boffset;
+	chan[1] = rows->base + rows->goffset;
+	chan[2] = rows->base + rows->roffset;
+	for (y=0; y<rows->height; y++, streamheight++) {
+		p = streamline[streamheight & 1];
+		a = streamheight ? streamline[(streamheight-1) & 1] : NULL;
+		gatherrow(chan, rows->stride, rows->packing, NULL, (long) y*rows->pitch, streamwidth, simd, p);
+		streamkeep(p, streamwidth);
+		if (streamspill && spillrow(p, a) != 0) return -1;
+	}
+	return 0;
+}
+
+
+/* Initialise network on the reservoir, sampling as many pixels as initnet
+   would on the whole picture, and start pass two
+   ----------------------------------------------------------------------- */
+
+void initnetstream()
+{
+	long kept;
+
+	kept = (streamseen < streamreserve) ? streamseen : streamreserve;
+	initnet(streamsample, 3*kept, samplefac);
+	learnpixels = streamseen / samplefac;
+	if (learnpixels > streamrevisit*kept) learnpixels = streamrevisit*kept;
+	streamy = 0;
+}
+
+
+/* Map the next rows of the picture, read again, in pass two
+   --------------------------------------------------------- */
+
+void streammap(const imageview *rows, unsigned char *indices, int indexpitch, int batched)
+{
+	const unsigned char *chan[3];
+	unsigned char *p,*q;
+	int y,simd,above;
+
+	if (streamsample == NULL || rows->width != streamwidth) return;
+	simd = gathersimd();
+	chan[0] = rows->base + rows->boffset;
+	chan[1] = rows->base + rows->goffset;
+	chan[2] = rows->base + rows->roffset;
+	for (y=0; y<rows->height; y++, streamy++) {
+		p = streamline[streamy & 1];
+		q = streamidx[streamy & 1];
+		above = (streamy+1) & 1;
+		gatherrow(chan, rows->stride, rows->packing, NULL, (long) y*rows->pitch, streamwidth, simd, p);
+		if (batched) batchsearch(p, streamwidth, q);
+		else if (streamy > 0) maprow(p, streamline[above], q, streamidx[above], streamwidth);
+		else maprow(p, NULL, q, NULL, streamwidth);
+		memcpy(indices + (long) y*indexpitch, q, streamwidth);
+	}
+}
+
+
+/* Map the spilled rows in pass two, handing each to sink in turn
+   -------------------------------------------------------------- */
+
+int streamspilled(rowsink sink, void *data, int batched)
+{
+	unsigned char *p,*q;
+	int y,t,above,status;
+
+	if (streamspill == NULL || fflush(streamspill) != 0) return -1;
+	rewind(streamspill);
+	for (y=0; y<streamheight; y++) {
+		p = streamline[y & 1];
+		q = streamidx[y & 1];
+		above = (y+1) & 1;
+		t = spillread(p, y ? streamline[above] : NULL, streamtokens);
+		if (t < 0) return -1;
+		spillmap(p, streamtokens, t, q, streamidx[above], batched);
+		if ((status = sink(q, y, data)) != 0) return status;
+	}
+	return 0;
+}
+
+
+/* Pixels read by pass one, kept in the reservoir and bytes spilled
+   ---------------------------------------------------------------- */
+
+void getstreamstats(long *pixels, long *kept, long *spilled)
+{
+	*pixels = streamseen;
+	*kept = (streamseen < streamreserve) ? streamseen : streamreserve;
+	*spilled = streamspillbytes;
+}
+
+
+/* Tiled pictures: train on pixels sampled on a sparse grid across the tiles,
+   then map whole tiles on several threads, each fetching, mapping and
+   storing its own
+   -------------------------------------------------------------------------- */
+
+typedef struct {
+	const tiledpicture *pic;
+	int across,tiles;			/* tiles in a row, and in all */
+	int batched;
+	int next;				/* next tile to map */
+	int status;				/* first failure, 0 = none */
+	pthread_mutex_t lock;			/* guards next and status */
+} tilejob;
+
+typedef struct {
+	tilejob *job;
+	long queries,visits,pixels,hits;	/* search and run counts of the thread */
+} tileworker;
+
+
+/* View tile (tx,ty), from fetch or cut from the picture's view
+   ------------------------------------------------------------ */
+
+static int tileview(const tiledpicture *pic, int tx, int ty, imageview *view)
+{
+	int x,y,w,h;
+
+	x = tx*pic->tilewidth;
+	y = ty*pic->tileheight;
+	w = (pic->tilewidth < pic->width-x) ? pic->tilewidth : pic->width-x;
+	h = (pic->tileheight < pic->height-y) ? pic->tileheight : pic->height-y;
+	if (pic->fetch) {
+		if (pic->fetch(tx, ty, view, pic->data) != 0) return -1;
+		if (view->width != w || view->height != h) {
+			if (pic->release) pic->release(tx, ty, pic->data);
+			return -1;
+		}
+		return 0;
+	}
+	*view = pic->view;
+	view->base += (long) y*view->pitch + (long) x*view->stride;
+	view->width = w;
+	view->height = h;
+	return 0;
+}
+
+
+/* Initialise network on a grid of pixels sampled across the tiles
+   --------------------------------------------------------------- */
+
+int initnettiled(const tiledpicture *pic, int sample)
+{
+	const unsigned char *chan[3];
+	imageview view;
+	long total,step,y,x,first,kept;
+	int across,down,tx,ty,y0,h,n,simd;
+
+	if (pic->width < 1 || pic->height < 1 || pic->tilewidth < 1 || pic->tileheight < 1) return -1;
+	if (streambegin(pic->tilewidth, sample, 0) != 0) return -1;
+
+	/* every step-th pixel of every step-th row, so the reservoir still */
+	/* chooses from about four times what it keeps */
+	total = (long) pic->width*pic->height;
+	step = (long) sqrt((double) total / (4.0*streamreserve));
+	if (step < 1) step = 1;
+	simd = gathersimd();
+	across = (pic->width + pic->tilewidth - 1) / pic->tilewidth;
+	down = (pic->height + pic->tileheight - 1) / pic->tileheight;
+	for (ty=0; ty<down; ty++) {
+		y0 = ty*pic->tileheight;
+		h = (pic->tileheight < pic->height-y0) ? pic->tileheight : pic->height-y0;
+		first = (y0 + step - 1) / step * step;
+		if (first >= y0 + h) continue;	/* no sampled row: never fetched */
+		for (tx=0; tx<across; tx++) {
+			if (tileview(pic, tx, ty, &view) != 0) {
+				streamend();
+				return -1;
+			}
+			chan[0] = view.base + view.boffset;
+			chan[1] = view.base + view.goffset;
+			chan[2] = view.base + view.roffset;
+			for (y=first; y<y0+h; y+=step) {
+				/* stagger the columns of each sampled row */
+				x = ((y/step)*7 % step - (long) tx*pic->tilewidth) % step;
+				if (x < 0) x += step;
+				if (x >= view.width) continue;
+				n = (view.width - x + step - 1) / step;
+				gatherrow(chan, view.stride*step, view.packing, NULL,
+					(y-y0)*view.pitch + x*view.stride, n, simd && step == 1, streamline[0]);
+				streamkeep(streamline[0], n);
+			}
+			if (pic->release) pic->release(tx, ty, pic->data);
+		}
+	}
+	kept = (streamseen < streamreserve) ? streamseen : streamreserve;
+	initnet(streamsample, 3*kept, samplefac);
+	learnpixels = total / samplefac;
+	if (learnpixels > streamrevisit*kept) learnpixels = streamrevisit*kept;
+	return 0;
+}
+
+
+/* Map tiles until none are left or one fails
+   ------------------------------------------ */
+
+static void *tilemapper(void *arg)
+{
+	tileworker *w;
+	tilejob *job;
+	const tiledpicture *pic;
+	const unsigned char *chan[3];
+	unsigned char *buf,*out;
+	imageview view;
+	long saved[4];
+	int k,tx,ty,pitch,status;
+
+	w = (tileworker *) arg;
+	job = w->job;
+	pic = job->pic;
+	saved[0] = searchqueries;		/* count this thread's work alone */
+	saved[1] = searchvisits;
+	saved[2] = runpixels;
+	saved[3] = runhits;
+	searchqueries = searchvisits = runpixels = runhits = 0;
+
+	buf = NULL;
+	status = 0;
+	if (pic->store && (buf = (unsigned char *) malloc((long) pic->tilewidth*pic->tileheight)) == NULL) status = -1;
+	while (status == 0) {
+		pthread_mutex_lock(&job->lock);
+		k = (job->status == 0 && job->next < job->tiles) ? job->next++ : -1;
+		pthread_mutex_unlock(&job->lock);
+		if (k < 0) break;
+		tx = k % job->across;
+		ty = k / job->across;
+		if (tileview(pic, tx, ty, &view) != 0) {
+			status = -1;
+			break;
+		}
+		chan[0] = view.base + view.boffset;
+		chan[1] = view.base + view.goffset;
+		chan[2] = view.base + view.roffset;
+		out = buf;
+		pitch = view.width;
+		if (buf == NULL) {
+			out = pic->indices + (long) ty*pic->tileheight*pic->indexpitch + (long) tx*pic->tilewidth;
+			pitch = pic->indexpitch;
+		}
+		mapsource(chan, view.stride, view.pitch, view.packing, NULL, view.width, view.height, out, pitch, 8, job->batched);
+		if (pic->store) status = pic->store(tx, ty, out, pitch, pic->data);
+		if (pic->release) pic->release(tx, ty, pic->data);
+	}
+	if (status != 0) {
+		pthread_mutex_lock(&job->lock);
+		if (job->status == 0) job->status = status;
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(buf);
+
+	w->queries = searchqueries;
+	w->visits = searchvisits;
+	w->pixels = runpixels;
+	w->hits = runhits;
+	searchqueries = saved[0];
+	searchvisits = saved[1];
+	runpixels = saved[2];
+	runhits = saved[3];
+	return NULL;
+}
+
+
+/* Map every tile on threads threads (0 = one per cpu)
+   --------------------------------------------------- */
+
+int tiledmap(const tiledpicture *pic, int threads, int batched)
+{
+	pthread_t thread[tilethreads];
+	tileworker worker[tilethreads];
+	tilejob job;
+	int i,started;
+
+	if (pic->width < 1 || pic->height < 1 || pic->tilewidth < 1 || pic->tileheight < 1) return -1;
+	job.pic = pic;
+	job.across = (pic->width + pic->tilewidth - 1) / pic->tilewidth;
+	job.tiles = job.across * ((pic->height + pic->tileheight - 1) / pic->tileheight);
+	job.batched = batched;
+	job.next = 0;
+	job.status = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	if (threads < 1) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#ifndef __GNUC__
+	threads = 1;
+#endif
+	if (threads > tilethreads) threads = tilethreads;
+	if (threads > job.tiles) threads = job.tiles;
+	if (threads < 1) threads = 1;
+	gathersimd();				/* build shared tables before sharing them */
+
+	/* this thread maps too, alongside any that start */
+	for (i=0; i<threads; i++) worker[i].job = &job;
+	for (started=1; started<threads; started++)
+		if (pthread_create(&thread[started], NULL, tilemapper, &worker[started]) != 0) break;
+	tilemapper(&worker[0]);
+	for (i=1; i<started; i++) pthread_join(thread[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	for (i=0; i<started; i++) {
+		searchqueries += worker[i].queries;
+		searchvisits += worker[i].visits;
+		runpixels += worker[i].pixels;
+		runhits += worker[i].hits;
+	}
+	return job.status;
+}
+
+
+/* GIF output: a header and palette, then index rows fed to an LZW encoder
+   as they are mapped, written in 255-byte sub-blocks
+   ----------------------------------------------------------------------- */
+
+static FILE *giffile;
+static int gifwidth,gifheight;
+static int gifrowsleft;				/* rows still to come */
+static int gifinitbits;				/* lzw minimum code size */
+static int gifclear;				/* clear code, end code is next */
+static int gifnext;				/* next code to assign */
+static int gifbits;				/* bits per code */
+static int gifprefix;				/* code of the string so far, -1 = none */
+static unsigned long gifacc;			/* bits waiting to be written */
+static int gifaccbits;
+static unsigned char gifblock[256];		/* sub-block being filled */
+static int gifkey[gifhash];			/* prefix << 8 | index, -1 = free */
+static short gifcode[gifhash];			/* code of that string */
+
+
+/* Write a 16-bit little-endian value
+   ---------------------------------- */
+
+static void gifword(int v)
+{
+	putc(v & 255, giffile);
+	putc((v >> 8) & 255, giffile);
+}
+
+
+/* Append a byte of data, writing each sub-block as it fills
+   --------------------------------------------------------- */
+
+static void gifbyte(int v)
+{
+	gifblock[++gifblock[0]] = v;
+	if (gifblock[0] == 255) {
+		fwrite(gifblock, 1, 256, giffile);
+		gifblock[0] = 0;
+	}
+}
+
+
+/* Append a code to the data, widening codes once the decoder will
+   --------------------------------------------------------------- */
+
+static void gifoutput(int code)
+{
+	gifacc |= (unsigned long) code << gifaccbits;
+	gifaccbits += gifbits;
+	for (; gifaccbits >= 8; gifaccbits -= 8) {
+		gifbyte(gifacc & 255);
+		gifacc >>= 8;
+	}
+	if (gifnext > (1 << gifbits) - 1 && gifbits < 12) gifbits++;
+}
+
+
+/* Empty the code table, telling the decoder to do the same
+   -------------------------------------------------------- */
+
+static void gifreset()
+{
+	memset(gifkey, -1, sizeof(gifkey));
+	gifnext = gifclear + 2;
+	gifbits = gifinitbits + 1;
+}
+
+
+/* Start a GIF of the current palette on f
+   --------------------------------------- */
+
+int gifbegin(FILE *f, int width, int height)
+{
+	unsigned char palette[3*netsize];
+	int n;
+
+	if (width < 1 || width > 65535 || height < 1 || height > 65535) return -1;
+	giffile = f;
+	gifwidth = width;
+	gifheight = height;
+	gifrowsleft = height;
+
+	/* the colour table has a power of two entries, at least 2 */
+	for (n=1; (1 << n) < netcolours; n++);
+	getpalette(palette, pixrgb8);
+	memset(palette + 3*netcolours, 0, 3*((1 << n) - netcolours));
+
+	fwrite("GIF89a", 1, 6, f);
+	gifword(width);
+	gifword(height);
+	putc(0xf0 | (n-1), f);			/* global table, 8-bit colour */
+	putc(0, f);				/* background */
+	putc(0, f);				/* square pixels */
+	fwrite(palette, 1, 3 << n, f);
+	putc(0x2c, f);				/* the image, covering the screen */
+	gifword(0);
+	gifword(0);
+	gifword(width);
+	gifword(height);
+	putc(0, f);
+
+	gifinitbits = (n < 2) ? 2 : n;
+	putc(gifinitbits, f);
+	gifclear = 1 << gifinitbits;
+	gifacc = 0;
+	gifaccbits = 0;
+	gifblock[0] = 0;
+	gifprefix = -1;
+	gifreset();
+	gifoutput(gifclear);
+	return ferror(f) ? -1 : 0;
+}
+
+
+/* Encode rows of colour indices, indexpitch bytes apart
+   ----------------------------------------------------- */
+
+int gifrows(const unsigned char *indices, int indexpitch, int rows)
+{
+	register const unsigned char *p;
+	register int key,h,x;
+	int y,prefix,step;
+
+	if (giffile == NULL || rows > gifrowsleft) return -1;
+	prefix = gifprefix;
+	for (y=0; y<rows; y++) {
+		p = indices + (long) y*indexpitch;
+		x = 0;
+		if (prefix < 0) prefix = p[x++];
+		for (; x<gifwidth; x++) {
+			/* extend the string if the table holds it, double hashing */
+			key = (prefix << 8) | p[x];
+			h = ((p[x] << 4) ^ prefix) % gifhash;
+			step = (h == 0) ? 1 : gifhash - h;
+			while (gifkey[h] >= 0 && gifkey[h] != key)
+				if ((h -= step) < 0) h += gifhash;
+			if (gifkey[h] == key) {
+				prefix = gifcode[h];
+				continue;
+			}
+			gifoutput(prefix);
+			if (gifnext < gifmaxcode) {
+				gifkey[h] = key;
+				gifcode[h] = gifnext++;
+			}
+			else {
+				gifoutput(gifclear);
+				gifreset();
+			}
+			prefix = p[x];
+		}
+	}
+	gifprefix = prefix;
+	gifrowsleft -= rows;
+	return ferror(giffile) ? -1 : 0;
+}
+
+
+/* Encode row y of a stream as a rowsink (data unused)
+   --------------------------------------------------- */
+
+int gifsink(const unsigned char *indices, int y, void *data)
+{
+	(void) data;
+	if (y != gifheight - gifrowsleft) return -1;
+	return gifrows(indices, gifwidth, 1);
+}
+
+
+/* Finish the GIF once all its rows are encoded
+   -------------------------------------------- */
+
+int gifend()
+{
+	FILE *f;
+
+	if (giffile == NULL) return -1;
+	f = giffile;
+	giffile = NULL;
+	if (gifrowsleft != 0) return -1;
+	gifoutput(gifprefix);
+	gifoutput(gifclear + 1);		/* end of information */
+	if (gifaccbits > 0) gifbyte(gifacc & 255);
+	if (gifblock[0]) fwrite(gifblock, 1, gifblock[0] + 1, f);
+	putc(0, f);				/* no more sub-blocks */
+	putc(0x3b, f);				/* trailer */
+	return ferror(f) ? -1 : 0;
+}
+
+
+/* Bands of rows passed from mapping to the encoder thread
+   ------------------------------------------------------- */
+
+typedef struct {
+	unsigned char *buf;			/* gifbands slots of bandrows rows */
+	int width,bandrows;
+	int rows[gifbands];			/* rows held in each slot */
+	int produced,consumed;			/* bands mapped and encoded */
+	int done;				/* no more bands will come */
+	int drain;				/* encode what is queued, then return */
+	int status;				/* first failure, 0 = none */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} gifpipe;
+
+static void *gifencoder(void *arg)
+{
+	gifpipe *pipe;
+	int slot,status;
+
+	pipe = (gifpipe *) arg;
+	for (;;) {
+		pthread_mutex_lock(&pipe->lock);
+		while (pipe->produced == pipe->consumed && !pipe->done && !pipe->drain)
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+		if (pipe->produced == pipe->consumed) {
+			pthread_mutex_unlock(&pipe->lock);
+			return NULL;
+		}
+		slot = pipe->consumed % gifbands;
+		pthread_mutex_unlock(&pipe->lock);
+
+		status = gifrows(pipe->buf + (long) slot*pipe->bandrows*pipe->width, pipe->width, pipe->rows[slot]);
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->consumed++;
+		if (status && !pipe->status) pipe->status = status;
+		pthread_cond_broadcast(&pipe->changed);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+
+/* Map an image view to a GIF on f, encoding each band of rows on another
+   thread while the next is mapped
+   ---------------------------------------------------------------------- */
+
+int mapgif(const imageview *view, FILE *f, int batched)
+{
+	gifpipe pipe;
+	pthread_t encoder;
+	imageview band;
+	int y,slot,threaded,status;
+
+	if (gifbegin(f, view->width, view->height) != 0) return -1;
+	pipe.width = view->width;
+	pipe.bandrows = planarchunk / view->width;
+	if (pipe.bandrows < 1) pipe.bandrows = 1;
+	pipe.buf = (unsigned char *) malloc((long) gifbands*pipe.bandrows*pipe.width);
+	if (pipe.buf == NULL) {
+		giffile = NULL;
+		return -1;
+	}
+	pipe.produced = pipe.consumed = 0;
+	pipe.done = pipe.drain = 0;
+	pipe.status = 0;
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.changed, NULL);
+	threaded = (pthread_create(&encoder, NULL, gifencoder, &pipe) == 0);
+	if (!threaded) pipe.drain = 1;		/* encode here, after each band */
+
+	band = *view;
+	for (y=0; y<view->height; y+=pipe.bandrows) {
+		/* wait for a free slot, noting any failure while locked */
+		pthread_mutex_lock(&pipe.lock);
+		while (threaded && pipe.produced - pipe.consumed == gifbands && !pipe.status)
+			pthread_cond_wait(&pipe.changed, &pipe.lock);
+		status = pipe.status;
+		pthread_mutex_unlock(&pipe.lock);
+		if (status) break;
+
+		slot = pipe.produced % gifbands;
+		band.base = view->base + (long) y*view->pitch;
+		band.height = (pipe.bandrows < view->height-y) ? pipe.bandrows : view->height-y;
+		mapview(&band, pipe.buf + (long) slot*pipe.bandrows*pipe.width, pipe.width, batched);
+		pipe.rows[slot] = band.height;
+
+		pthread_mutex_lock(&pipe.lock);
+		pipe.produced++;
+		pthread_cond_broadcast(&pipe.changed);
+		pthread_mutex_unlock(&pipe.lock);
+		if (!threaded) gifencoder(&pipe);
+	}
+
+	pthread_mutex_lock(&pipe.lock);
+	pipe.done = 1;
+	pthread_cond_broadcast(&pipe.changed);
+	pthread_mutex_unlock(&pipe.lock);
+	if (threaded) pthread_join(encoder, NULL);
+	pthread_mutex_destroy(&pipe.lock);
+	pthread_cond_destroy(&pipe.changed);
+	free(pipe.buf);
+
+	status = pipe.status;
+	if (status) giffile = NULL;
+	else status = gifend();
+	return status;
+}
+
+
+/* PNG output: bands of rows are mapped, packed and deflated on worker
+   threads, each as its own raw deflate stream ended by a full flush, and
+   written in order as consecutive IDAT chunks of one zlib stream
+   ---------------------------------------------------------------------- */
+
+typedef struct {
+	unsigned char *raw;			/* filter byte and packed indices per row */
+	unsigned char *packed;			/* deflated band */
+	long size;				/* bytes in packed */
+	long rawsize;				/* bytes in raw */
+	unsigned long adler;			/* adler32 of raw */
+	unsigned long crc;			/* crc32 of "IDAT" and packed */
+	int state;				/* pngfree, pngbusy or pngdone */
+} pngslot;
+
+typedef struct {
+	const imageview *view;
+	int bits,rowbytes;			/* bits per index, bytes per packed row */
+	int bandrows,bands;			/* rows in each band, and bands in all */
+	int slots;				/* bands in flight */
+	int batched;
+	int next;				/* next band to encode */
+	int written;				/* bands written */
+	int status;				/* first failure, 0 = none */
+	long capacity;				/* bytes allocated for packed */
+	pngslot slot[2*tilethreads];
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} pngjob;
+
+typedef struct {
+	pngjob *job;
+	long queries,visits,pixels,hits;	/* search and run counts of the thread */
+} pngworker;
+
+
+/* Write a 32-bit big-endian value
+   ------------------------------- */
+
+static void pngword(FILE *f, unsigned long v)
+{
+	putc((v >> 24) & 255, f);
+	putc((v >> 16) & 255, f);
+	putc((v >> 8) & 255, f);
+	putc(v & 255, f);
+}
+
+
+/* Write a chunk whose crc32 (of type and data) is known
+   ----------------------------------------------------- */
+
+static void pngchunk(FILE *f, const char *type, const unsigned char *data, long n, unsigned long crc)
+{
+	pngword(f, n);
+	fwrite(type, 1, 4, f);
+	if (n) fwrite(data, 1, n, f);
+	pngword(f, crc);
+}
+
+static void pngchunkcrc(FILE *f, const char *type, const unsigned char *data, long n)
+{
+	unsigned long crc;
+
+	crc = crc32(0L, (const Bytef *) type, 4);
+	if (n) crc = crc32(crc, data, n);
+	pngchunk(f, type, data, n, crc);
+}
+
+
+/* Map band k into its slot's rows, unfiltered as PNG advises for palette
+   images, and deflate it: the first band behind the zlib header, the
+   last ending the stream; 0 on success
+   ---------------------------------------------------------------------- */
+
+static int pngencode(pngjob *job, int k)
+{
+	const imageview *view;
+	const unsigned char *chan[3];
+	pngslot *s;
+	z_stream z;
+	int y,rows,start,flush,ok;
+
+	view = job->view;
+	s = &job->slot[k % job->slots];
+	rows = (job->bandrows < view->height - k*job->bandrows) ? job->bandrows : view->height - k*job->bandrows;
+	chan[0] = view->base + (long) k*job->bandrows*view->pitch + view->boffset;
+	chan[1] = view->base + (long) k*job->bandrows*view->pitch + view->goffset;
+	chan[2] = view->base + (long) k*job->bandrows*view->pitch + view->roffset;
+	mapsource(chan, view->stride, view->pitch, view->packing, NULL, view->width, rows,
+		s->raw + 1, job->rowbytes + 1, job->bits, job->batched);
+	for (y=0; y<rows; y++) s->raw[(long) y*(job->rowbytes + 1)] = 0;
+	s->rawsize = (long) rows*(job->rowbytes + 1);
+	s->adler = adler32(adler32(0L, Z_NULL, 0), s->raw, s->rawsize);
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+	start = 0;
+	if (k == 0) {
+		s->packed[start++] = 0x78;	/* 32k window, default level */
+		s->packed[start++] = 0x9c;
+	}
+	z.next_in = s->raw;
+	z.avail_in = s->rawsize;
+	z.next_out = s->packed + start;
+	z.avail_out = job->capacity - start;
+	flush = (k == job->bands-1) ? Z_FINISH : Z_FULL_FLUSH;
+	ok = deflate(&z, flush);
+	ok = (flush == Z_FINISH) ? ok == Z_STREAM_END : ok == Z_OK && z.avail_in == 0 && z.avail_out > 0;
+	s->size = start + z.total_out;
+	deflateEnd(&z);
+	if (!ok) return -1;
+	s->crc = crc32(crc32(0L, (const Bytef *) "IDAT", 4), s->packed, s->size);
+	return 0;
+}
+
+
+/* Encode bands into free slots until none are left or one fails
+   ------------------------------------------------------------- */
+
+static void *pngencoder(void *arg)
+{
+	pngworker *w;
+	pngjob *job;
+	int k,status;
+
+	w = (pngworker *) arg;
+	job = w->job;
+	pthread_mutex_lock(&job->lock);
+	while (!job->status && job->next < job->bands) {
+		k = job->next;
+		if (k - job->written >= job->slots) {	/* its slot is still being written */
+			pthread_cond_wait(&job->changed, &job->lock);
+			continue;
+		}
+		job->next++;
+		job->slot[k % job->slots].state = pngbusy;
+		pthread_mutex_unlock(&job->lock);
+
+		status = pngencode(job, k);
+
+		pthread_mutex_lock(&job->lock);
+		job->slot[k % job->slots].state = pngdone;
+		if (status && !job->status) job->status = status;
+		pthread_cond_broadcast(&job->changed);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	w->queries = searchqueries;
+	w->visits = searchvisits;
+	w->pixels = runpixels;
+	w->hits = runhits;
+	return NULL;
+}
+
+
+/* Map an image view to an indexed PNG on f, deflating bands on threads
+   -------------------------------------------------------------------- */
+
+int mappng(const imageview *view, FILE *f, int threads, int batched)
+{
+	static const unsigned char signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+	unsigned char header[13],palette[3*netsize],trailer[4];
+	pthread_t thread[tilethreads];
+	pngworker worker[tilethreads];
+	pngjob job;
+	pngslot *s;
+	unsigned long adler;
+	int i,k,started,status;
+
+	if (view->width < 1 || view->height < 1) return -1;
+	if (threads < 1) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#ifndef __GNUC__
+	threads = 1;
+#endif
+	if (threads > tilethreads) threads = tilethreads;
+	if (threads < 1) threads = 1;
+
+	/* the smallest depth holding every colour number */
+	memset(&job, 0, sizeof(job));
+	job.view = view;
+	for (job.bits=1; job.bits<8 && (1 << job.bits) < netcolours; job.bits*=2);
+	job.rowbytes = ((long) view->width*job.bits + 7) / 8;
+	job.bandrows = pngband / view->width;
+	if (job.bandrows < 1) job.bandrows = 1;
+	job.bands = (view->height + job.bandrows - 1) / job.bandrows;
+	job.slots = 2*threads;
+	if (job.slots > job.bands) job.slots = job.bands;
+	job.batched = batched;
+	job.capacity = compressBound((long) job.bandrows*(job.rowbytes + 1)) + 16;
+	for (i=0; i<job.slots; i++) {
+		job.slot[i].raw = (unsigned char *) malloc((long) job.bandrows*(job.rowbytes + 1));
+		job.slot[i].packed = (unsigned char *) malloc(job.capacity);
+		if (job.slot[i].raw == NULL || job.slot[i].packed == NULL) job.status = -1;
+	}
+	if (job.status) {			/* before anything reaches f */
+		for (i=0; i<job.slots; i++) {
+			free(job.slot[i].raw);
+			free(job.slot[i].packed);
+		}
+		return job.status;
+	}
+
+	fwrite(signature, 1, 8, f);
+	header[0] = view->width >> 24;
+	header[1] = view->width >> 16;
+	header[2] = view->width >> 8;
+	header[3] = view->width;
+	header[4] = view->height >> 24;
+	header[5] = view->height >> 16;
+	header[6] = view->height >> 8;
+	header[7] = view->height;
+	header[8] = job.bits;
+	header[9] = 3;				/* indexed colour */
+	header[10] = header[11] = header[12] = 0;	/* deflate, adaptive filters, no interlace */
+	pngchunkcrc(f, "IHDR", header, 13);
+	getpalette(palette, pixrgb8);
+	pngchunkcrc(f, "PLTE", palette, 3*netcolours);
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.changed, NULL);
+	gathersimd();				/* build shared tables before sharing them */
+	for (i=0; i<threads; i++) worker[i].job = &job;
+	for (started=0; started<threads; started++)
+		if (pthread_create(&thread[started], NULL, pngencoder, &worker[started]) != 0) break;
+
+	/* write the bands in order as they are done, freeing their slots */
+	adler = adler32(0L, Z_NULL, 0);
+	status = 0;
+	for (k=0; k<job.bands; k++) {
+		s = &job.slot[k % job.slots];
+		if (started == 0) status = pngencode(&job, k);
+		else {
+			pthread_mutex_lock(&job.lock);
+			while (s->state != pngdone && !job.status)
+				pthread_cond_wait(&job.changed, &job.lock);
+			status = job.status;	/* noted while locked */
+			pthread_mutex_unlock(&job.lock);
+		}
+		if (status) break;
+
+		pngchunk(f, "IDAT", s->packed, s->size, s->crc);
+		adler = adler32_combine(adler, s->adler, s->rawsize);
+
+		pthread_mutex_lock(&job.lock);
+		s->state = pngfree;
+		job.written++;
+		pthread_cond_broadcast(&job.changed);
+		pthread_mutex_unlock(&job.lock);
+	}
+	pthread_mutex_lock(&job.lock);
+	if (status) job.status = status;
+	pthread_cond_broadcast(&job.changed);	/* wake workers left waiting after a failure */
+	pthread_mutex_unlock(&job.lock);
+	for (i=0; i<started; i++) {
+		pthread_join(thread[i], NULL);
+		searchqueries += worker[i].queries;
+		searchvisits += worker[i].visits;
+		runpixels += worker[i].pixels;
+		runhits += worker[i].hits;
+	}
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.changed);
+	for (i=0; i<job.slots; i++) {
+		free(job.slot[i].raw);
+		free(job.slot[i].packed);
+	}
+	if (job.status) return job.status;
+
+	trailer[0] = adler >> 24;		/* the zlib stream's check value */
+	trailer[1] = adler >> 16;
+	trailer[2] = adler >> 8;
+	trailer[3] = adler;
+	pngchunkcrc(f, "IDAT", trailer, 4);
+	pngchunkcrc(f, "IEND", NULL, 0);
+	return ferror(f) ? -1 : 0;
+}
+
+
+/* Search a colour map of BGR triples for the nearest colour (for previews)
+   ------------------------------------------------------------------------ */
+
+int mapsearch(const unsigned char *map, int b, int g, int r)
+{
+	register int i,dist,a,bestd;
+	register const unsigned char *p;
+	int best;
+
+	bestd = 1000;		/* biggest possible dist is 256*3 */
+	best = 0;
+	p = map;
+	for (i=0; i<netcolours; i++, p+=3) {
+		dist = p[0] - b;   if (dist<0) dist = -dist;
+		a = p[1] - g;   if (a<0) a = -a;
+		dist += a;
+		a = p[2] - r;   if (a<0) a = -a;
+		dist += a;
+		if (dist<bestd) {bestd=dist; best=i;}
+	}
+	return(best);
 }
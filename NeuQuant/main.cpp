@@ -10,13 +10,97 @@
 #include "CImg.h"
 
 #include <cuda.h>
+#include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
+// Pixels mapped both ways to choose the sequential mapping kernel
+static const unsigned int probePixels = 16384;
+
+// Side of the tiles mapped in parallel from netpbm files
+static const int tileSide = 1024;
+
+static double cpuTime(void)
+{
+  struct timespec tp;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
+  return tp.tv_sec + tp.tv_nsec * 0.000000001;
+}
+
+// Quantize a PGM, PPM or PAM file read in place from its mapping, with no
+// decoded copy: trained from a sparse sample and mapped in parallel tiles,
+// so pictures larger than memory only need their index plane resident;
+// false if filename is not one
+static bool quantizeMapped(const char *filename, int searchMode, int searchEps, int metric)
+{
+  pnmfile pnm;
+  if (pnmopen(filename, &pnm) != 0)
+    return false;
+
+  const double startTime = cpuTime();
+  const int width = pnm.view.width;
+  const int height = pnm.view.height;
+  unsigned char *indices = new unsigned char[static_cast<size_t>(width) * height];
+  tiledpicture tiled = {width, height, tileSide, tileSide, NULL, NULL, NULL, NULL,
+      pnm.view, indices, width};
+
+  setmetric(metric);
+  pnmadvise(&pnm, accessrandom);
+  if (initnettiled(&tiled, 1) != 0)
+  {
+    delete [] indices;
+    pnmclose(&pnm);
+    return false;
+  }
+  learn();
+  streamend();
+  unbiasnet();
+  setsearch(searchMode);
+  setapprox(searchEps);
+  inxbuild();
+
+  // Choose the faster mapping kernel on probe rows, as for jpegs
+  imageview probe = pnm.view;
+  probe.height = (probePixels / width < 1) ? 1 : probePixels / width;
+  if (probe.height > height)
+    probe.height = height;
+
+  pnmadvise(&pnm, accesssequential);
+  double indexTime = cpuTime();
+  mapview(&probe, indices, width, 0);
+  indexTime = cpuTime() - indexTime;
+  double batchTime = cpuTime();
+  mapview(&probe, indices, width, 1);
+  batchTime = cpuTime() - batchTime;
+  if (tiledmap(&tiled, 0, batchTime < indexTime) != 0)
+  {
+    delete [] indices;
+    pnmclose(&pnm);
+    return false;
+  }
+
+  delete [] indices;
+  pnmclose(&pnm);
+  printf("%ld  %f\n", static_cast<long>(width) * height, cpuTime() - startTime);
+  return true;
+}
+
 int main(const int argc, const char * const * const argv)
 {
   // Note:  Change sequential to 'true' to run the GPU version
   const unsigned int sequential = false;
+  // Optional second argument selects the sequential mapping index, and
+  // the third the error allowed by searchapprox, and the fourth the
+  // distance used for learning and mapping (metricl1, metricl2); a fifth
+  // names a lut file whose palette every run maps with, written by the
+  // first run if it does not exist yet
+  const int searchMode = (argc > 2) ? atoi(argv[2]) : searchgreen;
+  const int searchEps = (argc > 3) ? atoi(argv[3]) : 0;
+  const int metric = (argc > 4) ? atoi(argv[4]) : metricl1;
+
+  // Raw netpbm input is trained and mapped straight from the file
+  if (sequential && quantizeMapped(argv[1], searchMode, searchEps, metric))
+    return 0;
 
   double elapsedTime = 0, thisTime = 0, startTime;
   struct timespec tp;
@@ -30,47 +114,79 @@ int main(const int argc, const char * const * const argv)
     imgRGBSlices.load_jpeg(argv[1]);
     if (imgRGBSlices.spectrum() != 3)
       return 1;
-    const unsigned int size = imgRGBSlices.width() * imgRGBSlices.height();
+    const long size = static_cast<long>(imgRGBSlices.width()) * imgRGBSlices.height();
 
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
     startTime = tp.tv_sec + tp.tv_nsec * 0.000000001;
 
     if (sequential)
     {
-      unsigned char *imgBGR = new unsigned char[imgRGBSlices.size()];
-      // Reshape the image into BGR order
+      // Train and map straight from CImg's float planes
       float *red = imgRGBSlices.data(0, 0, 0, 0),
           *green = imgRGBSlices.data(0, 0, 0, 1),
           *blue = imgRGBSlices.data(0, 0, 0, 2);
-      unsigned char *out = imgBGR;
-      for (unsigned int i = 0; i < size; ++i, ++red, ++green, ++blue)
-      {
-        out[0] = static_cast<unsigned int>(*blue);
-        out[1] = static_cast<unsigned int>(*green);
-        out[2] = static_cast<unsigned int>(*red);
-        out += 3;
-      }
-
-      red = imgRGBSlices.data(0, 0, 0, 0);
-      green = imgRGBSlices.data(0, 0, 0, 1);
-      blue = imgRGBSlices.data(0, 0, 0, 2);
-
-      // Initialize neuquant
-      initnet(imgBGR, 3*size, 1);
 
-      // Perform training
-      learn();
-      unbiasnet();
-
-        // Create output image (overwrite imgRGBSlices)
-      for (unsigned int i = 0; i < size; ++i, ++red, ++green, ++blue)
+      // A shared lut fixes the palette, so there is nothing to train
+      unsigned char colourMap[3 * netsize];
+      setmetric(metric);
+      if (argc <= 5 || lutload(argv[5], 0, colourMap) != 0)
       {
-        unsigned char index = inxsearch(*blue, *green, *red);
-        *red = getNetwork(index, 2);
-        *green = getNetwork(index, 1);
-        *blue = getNetwork(index, 0);
+        // Initialize neuquant
+        initnetplanarf(blue, green, red, size, 1);
+
+        // Perform training
+        learn();
+        unbiasnet();
+
+        // Build the search index (this sorts the network, so keep the map)
+        getcolourmap(colourMap);
+        setsearch(searchMode);
+        setapprox(searchEps);
+        inxbuild();
+
+        // Seed a missing shared lut, but never replace one other runs map
+        if (argc > 5 && access(argv[5], F_OK) != 0)
+        {
+          setsearch(searchlut);
+          inxbuild();
+          lutsave(argv[5]);
+        }
       }
-      delete [] imgBGR;
+
+      // Map probe rows with the run-aware index search and with the
+      // batched brute-force kernel, then map the rest with the faster
+      const unsigned int width = imgRGBSlices.width();
+      const unsigned int height = imgRGBSlices.height();
+      unsigned char *indices = new unsigned char[size];
+      unsigned int probeRows = probePixels / width;
+      if (probeRows < 1)
+        probeRows = 1;
+      if (probeRows > height)
+        probeRows = height;
+      const unsigned int probe = probeRows * width;
+      double indexTime, batchTime;
+
+      indexTime = cpuTime();
+      mapplanarf(blue, green, red, width, probeRows, indices, 0);
+      indexTime = cpuTime() - indexTime;
+      batchTime = cpuTime();
+      mapplanarf(blue, green, red, width, probeRows, indices, 1);
+      batchTime = cpuTime() - batchTime;
+
+      const bool batched = batchTime < indexTime;
+      mapplanarf(blue + probe, green + probe, red + probe, width,
+          height - probeRows, indices + probe, batched);
+
+      // Create output image (overwrite imgRGBSlices) from the indices
+      reconstructplanarf(indices, size, colourMap, blue, green, red);
+      delete [] indices;
+
+      long queries, visits, pixels, hits;
+      getsearchstats(&queries, &visits);
+      getrunstats(&pixels, &hits);
+      fprintf(stderr, "search %d: %f visits/query, %f run hits, %s mapping\n",
+          searchMode, static_cast<double>(visits) / queries,
+          static_cast<double>(hits) / pixels, batched ? "batch" : "index");
     }
     else
     {
@@ -83,7 +199,7 @@ int main(const int argc, const char * const * const argv)
     thisTime = (tp.tv_sec + tp.tv_nsec * 0.000000001) - startTime;
     elapsedTime += thisTime;
 
-    printf("%d  %f\n", size, thisTime);
+    printf("%ld  %f\n", size, thisTime);
 
   }
   catch (std::exception &e)